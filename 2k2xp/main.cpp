@@ -4,108 +4,102 @@
 #include <iostream>
 #include <stdexcept>
 
+#include <cstdlib>
+
 #include "util.h"
 #include "bitmap.h"
+#include "outputtree.h"
+#include "casefoldeddir.h"
+
+#ifndef OS_W32
+//Existing folder called name in any case, or name itself
+static std::string findDir(const CaseFoldedDir &dir, const char *name)
+{
+    const Util::DirEntry *entry = dir.find(name, Util::DirEntry::Directory);
+    return (entry != NULL ? entry->name : std::string(name)) + PATH_SEPARATOR;
+}
+#endif
 
-int unimain(const std::vector<std::string> &args)
+int unimain(const std::vector<std::string> &argv)
 {
+    //Split off flags
+    unsigned int scale = 1;
+    std::vector<std::string> args;
+    for (unsigned int i = 0; i < argv.size(); ++i) {
+        if (argv[i] == "--scale" && i + 1 < argv.size())
+            scale = atoi(argv[++i].c_str());
+        else
+            args.push_back(argv[i]);
+    }
+
     if (args.size() < 2) {
-        std::cerr << "usage: 2k2xp 2k_project_path xp_project_path" << std::endl;
+        std::cerr << "usage: 2k2xp [--scale N] 2k_project_path xp_project_path" << std::endl;
+        return 1;
+    }
+    if (scale < 1 || scale > BITMAP_MAX_SCALE) {
+        std::cerr << "error: --scale must be between 1 and " << BITMAP_MAX_SCALE << std::endl;
         return 1;
     }
 
     std::string srcPath = Util::sanitizeDirPath(args[0]);
     std::string dstPath = Util::sanitizeDirPath(args[1]);
 
-    if (!Util::dirExists(dstPath))
-        Util::mkdir(dstPath);
+    OutputTree tree(dstPath);
     
-    //Get all paths set up
+    //Get all paths set up; output paths are relative to dstPath
 #ifdef OS_W32
-    std::string charsetPath = srcPath + "CharSet";
-    std::string chipsetPath = srcPath + "ChipSet";
-    std::string charactersPath = dstPath + "Characters";
-    std::string autotilesPath = dstPath + "Autotiles";
-    std::string tilesetsPath = dstPath + "Tilesets";
-    if (!Util::dirExists(charactersPath))
-        Util::mkdir(charactersPath);
-    if (!Util::dirExists(autotilesPath))
-        Util::mkdir(autotilesPath);
-    if (!Util::dirExists(tilesetsPath))
-        Util::mkdir(tilesetsPath);
+    std::string charsetPath = srcPath + "CharSet" PATH_SEPARATOR;
+    std::string chipsetPath = srcPath + "ChipSet" PATH_SEPARATOR;
+    std::string charactersPath = "Characters" PATH_SEPARATOR;
+    std::string autotilesPath = "Autotiles" PATH_SEPARATOR;
+    std::string tilesetsPath = "Tilesets" PATH_SEPARATOR;
 #else
-    std::string charsetPath;
-    std::string chipsetPath;
-    {
-        std::vector<std::string> files = Util::listFiles(srcPath);
-        for (unsigned int i = 0; i < files.size(); ++i) {
-            std::string fullpath = srcPath + files[i] + PATH_SEPARATOR;
-            if (!Util::dirExists(fullpath))
-                continue;
-            std::string file = Util::toLower(files[i]);
-            if (file == "charset")
-                charsetPath = fullpath;
-            else if (file == "chipset")
-                chipsetPath = fullpath;
-        }
-    }
-    if (charsetPath.empty() || chipsetPath.empty()) {
+    const CaseFoldedDir &srcDir = CaseFoldedDir::get(srcPath);
+    const Util::DirEntry *charsetDir = srcDir.find("CharSet", Util::DirEntry::Directory);
+    const Util::DirEntry *chipsetDir = srcDir.find("ChipSet", Util::DirEntry::Directory);
+    if (charsetDir == NULL || chipsetDir == NULL) {
         std::cerr << "error: couldn't find ChipSet and CharSet folders" << std::endl;
         return 1;
     }
-    std::string charactersPath;
-    std::string autotilesPath;
-    std::string tilesetsPath;
-    {
-        std::vector<std::string> files = Util::listFiles(dstPath);
-        for (unsigned int i = 0; i < files.size(); ++i) {
-            std::string fullpath = dstPath + files[i] + PATH_SEPARATOR;
-            if (!Util::dirExists(fullpath))
-                continue;
-            std::string file = Util::toLower(files[i]);
-            if (file == "characters")
-                charactersPath = fullpath;
-            else if (file == "autotiles")
-                autotilesPath = fullpath;
-            else if (file == "tilesets")
-                tilesetsPath = fullpath;
-        }
-    }
-    if (charactersPath.empty()) {
-        charactersPath = dstPath + "Characters" PATH_SEPARATOR;
-        Util::mkdir(charactersPath);
-    }
-    if (autotilesPath.empty()) {
-        autotilesPath = dstPath + "Autotiles" PATH_SEPARATOR;
-        Util::mkdir(autotilesPath);
-    }
-    if (tilesetsPath.empty()) {
-        tilesetsPath = dstPath + "Tilesets" PATH_SEPARATOR;
-        Util::mkdir(tilesetsPath);
-    }
+    std::string charsetPath = srcPath + charsetDir->name + PATH_SEPARATOR;
+    std::string chipsetPath = srcPath + chipsetDir->name + PATH_SEPARATOR;
+
+    const CaseFoldedDir &dstDir = CaseFoldedDir::get(dstPath);
+    std::string charactersPath = findDir(dstDir, "Characters");
+    std::string autotilesPath = findDir(dstDir, "Autotiles");
+    std::string tilesetsPath = findDir(dstDir, "Tilesets");
 #endif
+    tree.mkdirs(charactersPath);
+    tree.mkdirs(autotilesPath);
+    tree.mkdirs(tilesetsPath);
     //Convert CharSets
-    std::vector<std::string> files = Util::listFiles(charsetPath);
+    std::vector<Util::DirEntry> files = Util::listEntries(charsetPath);
     for (unsigned int i = 0; i < files.size(); ++i) {
+        if (files[i].type != Util::DirEntry::File)
+            continue;
         try {
-            std::string noext = Util::getWithoutExtension(files[i]);
-            Bitmap src(charsetPath + files[i]);
+            std::string noext = Util::getWithoutExtension(files[i].name);
+            Bitmap src(charsetPath + files[i].name);
+
+            //The frames tile each image, so it needs no clearing unless the
+            //charset is too small to fill it
+            Bitmap::Contents contents = src.getWidth() >= 24 * 12 && src.getHeight() >= 32 * 8 ? Bitmap::Undefined : Bitmap::Cleared;
 
             for (int j = 0; j < 8; ++j) {
-                Bitmap dst(96, 128);
+                Bitmap dst(96, 128, contents);
                 static const int translation[4] = {2, 3, 1, 0};
                 for (int k = 0; k < 4; ++k) {
                     //Walk down frames 1+2
-                    dst.blit(24 * 0, 32 * k, src, ((j%4) * 24 * 3) + 24 * 1, (j/4 * 32 * 4) + 32 * translation[k], 24 * 2, 32 * 1);
+                    dst.blit(24 * 0, 32 * k, src, ((j%4) * 24 * 3) + 24 * 1, (j/4 * 32 * 4) + 32 * translation[k], 24 * 2, 32 * 1, Bitmap::Opaque);
                     //Walk down frame 3
-                    dst.blit(24 * 2, 32 * k, src, ((j%4) * 24 * 3) + 24 * 1, (j/4 * 32 * 4) + 32 * translation[k], 24 * 1, 32 * 1);
+                    dst.blit(24 * 2, 32 * k, src, ((j%4) * 24 * 3) + 24 * 1, (j/4 * 32 * 4) + 32 * translation[k], 24 * 1, 32 * 1, Bitmap::Opaque);
                     //Walk down frame 4
-                    dst.blit(24 * 3, 32 * k, src, ((j%4) * 24 * 3) + 24 * 0, (j/4 * 32 * 4) + 32 * translation[k], 24 * 1, 32 * 1);
+                    dst.blit(24 * 3, 32 * k, src, ((j%4) * 24 * 3) + 24 * 0, (j/4 * 32 * 4) + 32 * translation[k], 24 * 1, 32 * 1, Bitmap::Opaque);
                 }
 
                 std::ostringstream dstName;
                 dstName << charactersPath << noext << "-" << (j+1) << ".png";
-                dst.writeToPng(dstName.str(), true, src.getPalette());
+                dst.writeToPng(tree, dstName.str(), true, src.getPalette(), scale);
             }
         } catch (std::runtime_error &e) {
             std::cerr << "warning: " << e.what() << std::endl;
@@ -113,18 +107,18 @@ int unimain(const std::vector<std::string> &args)
     }
 
     //Convert ChipSets
-    files = Util::listFiles(chipsetPath);
+    files = Util::listEntries(chipsetPath);
 
     //Convert/split autotiles and chipset
     for (unsigned int i = 0; i < files.size(); ++i) {
+        if (files[i].type != Util::DirEntry::File)
+            continue;
         try {
-            std::string noext = Util::getWithoutExtension(files[i]);
-            Bitmap src(chipsetPath + files[i]);
+            std::string noext = Util::getWithoutExtension(files[i].name);
+            Bitmap src(chipsetPath + files[i].name);
 
             //Start with autotiles
             for (unsigned int j = 0; j < 12; ++j) {
-                Bitmap dst(16 * 3, 16 * 4);
-
                 int x, y;
                 if (j < 4) {
                     x = (j%2) * 16 * 3;
@@ -133,11 +127,20 @@ int unimain(const std::vector<std::string> &args)
                     x = (j%2+2) * 16 * 3;
                     y = (j/2-2) * 16 * 4;
                 }
-                dst.blit(0, 0, src, x, y, 16*3, 16*4);
+
+                //A plain slice of the chipset; written straight from it
+                BitmapView slice = src.view(x, y, 16*3, 16*4);
+                Bitmap padded;
+                if (slice.getWidth() < 16*3 || slice.getHeight() < 16*4) {
+                    //Short chipset; the rest of the autotile stays blank
+                    padded = Bitmap(16*3, 16*4);
+                    padded.blit(0, 0, slice, 0, 0, slice.getWidth(), slice.getHeight());
+                    slice = padded;
+                }
 
                 std::ostringstream dstName;
                 dstName << autotilesPath << noext << "-" << (j+1) << ".png";
-                dst.writeToPng(dstName.str(), true, src.getPalette());
+                slice.writeToPng(tree, dstName.str(), true, src.getPalette(), scale);
             }
 
             //Do water autotiles (ugh)
@@ -203,33 +206,34 @@ int unimain(const std::vector<std::string> &args)
 
                 std::ostringstream dstName;
                 dstName << autotilesPath << noext << "-water" << (j+1) << ".png";
-                dst.writeToPng(dstName.str(), true, src.getPalette());
+                dst.writeToPng(tree, dstName.str(), true, src.getPalette(), scale);
             }
 
-            //Do the tileset (easy street)
-            Bitmap dst(16 * 8, 16 * 36);
+            //Do the tileset (easy street); the pieces cover it exactly once
+            bool complete = src.getWidth() >= 16 * 30 && src.getHeight() >= 16 * 16;
+            Bitmap dst(16 * 8, 16 * 36, complete ? Bitmap::Undefined : Bitmap::Cleared);
             //Copy layer 1 square chunk
-            dst.blit(16 * 0, 16 * 0, src, 16 * 3 * 4, 16 * 0, 16 * 8, 16 * 8);
+            dst.blit(16 * 0, 16 * 0, src, 16 * 3 * 4, 16 * 0, 16 * 8, 16 * 8, Bitmap::Opaque);
             //Copy layer 1 segmented square
-            dst.blit(16 * 0, 16 * 8, src, 16 * 3 * 4 + 16 * 8, 16 * 0, 16 * 4, 16 * 8);
-            dst.blit(16 * 4, 16 * 8, src, 16 * 3 * 4, 16 * 8, 16 * 4, 16 * 8);
+            dst.blit(16 * 0, 16 * 8, src, 16 * 3 * 4 + 16 * 8, 16 * 0, 16 * 4, 16 * 8, Bitmap::Opaque);
+            dst.blit(16 * 4, 16 * 8, src, 16 * 3 * 4, 16 * 8, 16 * 4, 16 * 8, Bitmap::Opaque);
             //Copy remainder of layer 1
             for(int j = 0; j < 4; j++) {
-                dst.blit(16 * j * 2, 16 * 8 * 2, src, 16 * 3 * 4 + 16 * 4, 16 * 8 + 16 * j * 2, 16 * 2, 16 * 2);
+                dst.blit(16 * j * 2, 16 * 8 * 2, src, 16 * 3 * 4 + 16 * 4, 16 * 8 + 16 * j * 2, 16 * 2, 16 * 2, Bitmap::Opaque);
             }
 
             //Copy layer 2 square chunk
-            dst.blit(16 * 0, 16 * 8 * 2 + 16 * 2, src, 16 * 3 * 4 + 16 * 6, 16 * 8, 16 * 8, 16 * 8);
+            dst.blit(16 * 0, 16 * 8 * 2 + 16 * 2, src, 16 * 3 * 4 + 16 * 6, 16 * 8, 16 * 8, 16 * 8, Bitmap::Opaque);
             //Copy layer 2 segmented square
-            dst.blit(16 * 0, 16 * 8 * 3 + 16 * 2, src, 16 * 3 * 4 + 16 * 12, 16 * 0, 16 * 6, 16 * 8);
-            dst.blit(16 * 6, 16 * 8 * 3 + 16 * 2, src, 16 * 3 * 4 + 16 * 14, 16 * 8, 16 * 2, 16 * 8);
+            dst.blit(16 * 0, 16 * 8 * 3 + 16 * 2, src, 16 * 3 * 4 + 16 * 12, 16 * 0, 16 * 6, 16 * 8, Bitmap::Opaque);
+            dst.blit(16 * 6, 16 * 8 * 3 + 16 * 2, src, 16 * 3 * 4 + 16 * 14, 16 * 8, 16 * 2, 16 * 8, Bitmap::Opaque);
             //Copy remainder of layer 2
             for(int j = 0; j < 4; j++) {
-                dst.blit(16 * j * 2, 16 * 8 * 4 + 16 * 2, src, 16 * 3 * 4 + 16 * 16, 16 * 8 + 16 * j * 2, 16 * 2, 16 * 2);
+                dst.blit(16 * j * 2, 16 * 8 * 4 + 16 * 2, src, 16 * 3 * 4 + 16 * 16, 16 * 8 + 16 * j * 2, 16 * 2, 16 * 2, Bitmap::Opaque);
             }
 
             //Write the file
-            dst.writeToPng(tilesetsPath + files[i], true, src.getPalette());
+            dst.writeToPng(tree, tilesetsPath + files[i].name, true, src.getPalette(), scale);
         } catch (std::runtime_error &e) {
             std::cerr << "warning: " << e.what() << std::endl;
         }
@@ -0,0 +1,263 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <chrono>
+
+#include "bitmap.h"
+#include "paletteremap.h"
+#include "util.h"
+
+//Checks Bitmap::blit and PaletteRemap against plain per-pixel loops and times
+//them on tile-sized and layer-sized rectangles
+
+//Deterministic, so failures reproduce
+static uint32_t nextRandom(uint32_t &state)
+{
+    state = state * 1103515245 + 12345;
+    return state >> 8;
+}
+
+//About a third transparent, like a chipset
+static void fill(Bitmap &bitmap, uint32_t &state)
+{
+    for (unsigned int y = 0; y < bitmap.getHeight(); ++y) {
+        uint8_t *row = bitmap.getRow(y);
+        for (unsigned int x = 0; x < bitmap.getWidth(); ++x) {
+            uint32_t r = nextRandom(state);
+            row[x] = r % 3 == 0 ? 0 : 1 + (r >> 2) % 255;
+        }
+    }
+}
+
+//Between two random palettes, so the table points all over the place
+static PaletteRemap randomRemap(uint32_t &state, bool transparent)
+{
+    std::vector<uint8_t> from(3 * (1 + nextRandom(state) % 256)), to(3 * (1 + nextRandom(state) % 256));
+    for (unsigned int i = 0; i < from.size(); ++i)
+        from[i] = nextRandom(state);
+    for (unsigned int i = 0; i < to.size(); ++i)
+        to[i] = nextRandom(state);
+    return PaletteRemap(from, to, transparent);
+}
+
+//The blit loop from before clipping and SIMD: two offsets and a branch per
+//pixel. It trusts the rectangle to lie inside both bitmaps.
+static void blitOld(Bitmap &dst, int mX, int mY, const BitmapView &src, int oX, int oY, int oW, int oH)
+{
+    for (int y = 0; y < oH; ++y) {
+        for (int x = 0; x < oW; ++x) {
+            uint8_t pixel = src.getRow(oY + y)[oX + x];
+            if (pixel != 0)
+                dst.getRow(mY + y)[mX + x] = pixel;
+        }
+    }
+}
+
+//The same loop, skipping every pixel outside either bitmap and translating
+//the rest
+static void blitReference(Bitmap &dst, int mX, int mY, const BitmapView &src, int oX, int oY, int oW, int oH,
+                          const PaletteRemap &remap, Bitmap::BlitMode mode)
+{
+    for (int y = 0; y < oH; ++y) {
+        for (int x = 0; x < oW; ++x) {
+            if (oX + x < 0 || oY + y < 0 || oX + x >= static_cast<int>(src.getWidth()) || oY + y >= static_cast<int>(src.getHeight()))
+                continue;
+            if (mX + x < 0 || mY + y < 0 || mX + x >= static_cast<int>(dst.getWidth()) || mY + y >= static_cast<int>(dst.getHeight()))
+                continue;
+            uint8_t pixel = remap[src.getRow(oY + y)[oX + x]];
+            if (pixel != 0 || mode == Bitmap::Opaque)
+                dst.getRow(mY + y)[mX + x] = pixel;
+        }
+    }
+}
+
+static bool samePixels(const Bitmap &a, const Bitmap &b)
+{
+    for (unsigned int y = 0; y < a.getHeight(); ++y) {
+        for (unsigned int x = 0; x < a.getWidth(); ++x) {
+            if (a.getRow(y)[x] != b.getRow(y)[x])
+                return false;
+        }
+    }
+    return true;
+}
+
+//Random rectangles, partly or wholly outside either bitmap, in both modes,
+//every third one through a remap. Odd sizes exercise the tails of the vector
+//loops.
+static unsigned int check()
+{
+    uint32_t state = 1;
+    std::vector<PaletteRemap> remaps;
+    remaps.push_back(PaletteRemap());
+    for (unsigned int i = 0; i < 8; ++i)
+        remaps.push_back(randomRemap(state, i % 2 == 0));
+
+    unsigned int mismatches = 0;
+    for (unsigned int i = 0; i < 20000; ++i) {
+        Bitmap src(1 + nextRandom(state) % 100, 1 + nextRandom(state) % 100);
+        Bitmap expected(1 + nextRandom(state) % 100, 1 + nextRandom(state) % 100);
+        fill(src, state);
+        fill(expected, state);
+        Bitmap actual(expected);
+
+        int mX = static_cast<int>(nextRandom(state) % 140) - 20;
+        int mY = static_cast<int>(nextRandom(state) % 140) - 20;
+        int oX = static_cast<int>(nextRandom(state) % 140) - 20;
+        int oY = static_cast<int>(nextRandom(state) % 140) - 20;
+        int oW = static_cast<int>(nextRandom(state) % 130) - 5;
+        int oH = static_cast<int>(nextRandom(state) % 130) - 5;
+        Bitmap::BlitMode mode = i % 4 == 0 ? Bitmap::Opaque : Bitmap::Transparent;
+        unsigned int remap = i % 3 == 0 ? 1 + nextRandom(state) % (remaps.size() - 1) : 0;
+
+        blitReference(expected, mX, mY, src, oX, oY, oW, oH, remaps[remap], mode);
+        if (remap != 0)
+            actual.blit(mX, mY, src, oX, oY, oW, oH, remaps[remap], mode);
+        else
+            actual.blit(mX, mY, src, oX, oY, oW, oH, mode);
+        if (!samePixels(expected, actual) && ++mismatches <= 10) {
+            std::cerr << "  " << (mode == Bitmap::Opaque ? "opaque" : "transparent") << (remap != 0 ? " remapped" : "") << " blit of "
+                      << oW << "x" << oH << " from (" << oX << ", " << oY << ") of "
+                      << src.getWidth() << "x" << src.getHeight() << " to (" << mX << ", " << mY << ") of "
+                      << expected.getWidth() << "x" << expected.getHeight() << " differs" << std::endl;
+        }
+    }
+    std::cout << "20000 random rectangles: " << mismatches << " mismatches" << std::endl;
+    return mismatches;
+}
+
+//PaletteRemap::apply, with whichever row kernel this CPU gets, against a
+//lookup per index: random tables, lengths and offsets, in place or not, and
+//Bitmap::remap on top
+static unsigned int checkRemap()
+{
+    uint32_t state = 3;
+    unsigned int mismatches = 0;
+    std::vector<uint8_t> src(320), expected(320), actual(320);
+    for (unsigned int i = 0; i < 1000; ++i) {
+        PaletteRemap remap = randomRemap(state, i % 4 == 0);
+        for (unsigned int j = 0; j < 20; ++j) {
+            for (unsigned int k = 0; k < src.size(); ++k)
+                src[k] = nextRandom(state);
+            unsigned int offset = nextRandom(state) % 40;
+            unsigned int n = nextRandom(state) % 280;
+            bool inPlace = j % 2 == 0;
+
+            for (unsigned int k = 0; k < n; ++k)
+                expected[k] = remap[src[offset + k]];
+            if (inPlace) {
+                actual = src;
+                remap.apply(&actual[offset], &actual[offset], n);
+            } else {
+                remap.apply(&actual[offset], &src[offset], n);
+            }
+            if (!std::equal(expected.begin(), expected.begin() + n, actual.begin() + offset) && ++mismatches <= 10)
+                std::cerr << "  " << (inPlace ? "in-place " : "") << "remap of " << n << " indices at " << offset << " differs" << std::endl;
+        }
+
+        Bitmap bitmap(1 + nextRandom(state) % 100, 1 + nextRandom(state) % 100);
+        fill(bitmap, state);
+        Bitmap reference(bitmap);
+        for (unsigned int y = 0; y < reference.getHeight(); ++y) {
+            for (unsigned int x = 0; x < reference.getWidth(); ++x)
+                reference.getRow(y)[x] = remap[reference.getRow(y)[x]];
+        }
+        bitmap.remap(remap);
+        if ((!samePixels(reference, bitmap) || bitmap.getPalette() != remap.getPalette()) && ++mismatches <= 10)
+            std::cerr << "  remap of a " << bitmap.getWidth() << "x" << bitmap.getHeight() << " bitmap differs" << std::endl;
+    }
+
+    //No palette to take on; the bitmap keeps its own
+    Bitmap bitmap(8, 8);
+    bitmap.remap(randomRemap(state, false));
+    std::vector<uint8_t> palette = bitmap.getPalette();
+    bitmap.remap(PaletteRemap());
+    if (bitmap.getPalette() != palette && ++mismatches <= 10)
+        std::cerr << "  identity remap replaced the palette" << std::endl;
+
+    std::cout << "20000 random rows, 1000 bitmaps: " << mismatches << " remap mismatches" << std::endl;
+    return mismatches;
+}
+
+//Nanoseconds per blit of a w x h rectangle, from random places in a chipset
+//onto a layer; best of five runs
+static double timeBlits(bool old, int w, int h, unsigned int count)
+{
+    uint32_t state = 2;
+    Bitmap src(480, 256), dst(480, 256);
+    fill(src, state);
+
+    std::vector<int> places(count * 4);
+    for (unsigned int i = 0; i < count; ++i) {
+        places[i * 4 + 0] = nextRandom(state) % (481 - w);
+        places[i * 4 + 1] = nextRandom(state) % (257 - h);
+        places[i * 4 + 2] = nextRandom(state) % (481 - w);
+        places[i * 4 + 3] = nextRandom(state) % (257 - h);
+    }
+
+    double best = 0;
+    for (unsigned int run = 0; run < 5; ++run) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < count; ++i) {
+            const int *p = &places[i * 4];
+            if (old)
+                blitOld(dst, p[0], p[1], src, p[2], p[3], w, h);
+            else
+                dst.blit(p[0], p[1], src, p[2], p[3], w, h);
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        if (run == 0 || elapsed.count() < best)
+            best = elapsed.count();
+    }
+    return best / count;
+}
+
+static void benchmark()
+{
+    static const struct
+    {
+        const char *name;
+        int w, h;
+        unsigned int count;
+    } cases[] = {
+        {"8x8 subtiles", 8, 8, 200000},
+        {"16x16 tiles", 16, 16, 100000},
+        {"480x256 composite", 480, 256, 200},
+    };
+    for (unsigned int i = 0; i < ARRAY_SIZE(cases); ++i) {
+        std::cout << cases[i].name << ": old " << timeBlits(true, cases[i].w, cases[i].h, cases[i].count)
+                  << " ns, new " << timeBlits(false, cases[i].w, cases[i].h, cases[i].count)
+                  << " ns per blit" << std::endl;
+    }
+}
+
+int unimain(const std::vector<std::string> &args)
+{
+    bool doCheck = true, doBench = true;
+    if (args.size() == 1 && args[0] == "--check") {
+        doBench = false;
+    } else if (args.size() == 1 && args[0] == "--bench") {
+        doCheck = false;
+    } else if (!args.empty()) {
+        std::cerr << "usage: blitbench [--check | --bench]" << std::endl;
+        return 1;
+    }
+
+    try {
+        if (doCheck && check() != 0) {
+            std::cerr << "error: Bitmap::blit differs from the per-pixel loop" << std::endl;
+            return 1;
+        }
+        if (doCheck && checkRemap() != 0) {
+            std::cerr << "error: PaletteRemap differs from the per-index lookup" << std::endl;
+            return 1;
+        }
+        if (doBench)
+            benchmark();
+    } catch (std::runtime_error &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -2,481 +2,676 @@
 
 #include <stdexcept>
 #include <algorithm>
+#include <utility>
 
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 
-#include <png.h>
-#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2
+#endif
+#endif
 
 #include "os.h"
 #include "util.h"
+#include "outputtree.h"
+#include "imagestream.h"
+#include "bufferpool.h"
+#include "paletteremap.h"
+#include "contenthash.h"
+#include "rgbabitmap.h"
+#include "quantizer.h"
+#include "imageutil.h"
+
+//Transparent blit of a single row: copies every nonzero byte of src to dst
+typedef void (*BlitRow)(uint8_t *dst, const uint8_t *src, size_t n);
+
+static void blitRowScalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    //Eight pixels at a time: build a mask of the zero bytes of src and blend
+    const uint64_t low7 = UINT64_C(0x7F7F7F7F7F7F7F7F);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t s, d;
+        memcpy(&s, src + i, 8);
+        if (s == 0)
+            continue;
+        memcpy(&d, dst + i, 8);
+        uint64_t zero = ~(((s & low7) + low7) | s | low7); //0x80 in each zero byte
+        uint64_t keep = (zero >> 7) * 0xFF;
+        d = (d & keep) | (s & ~keep);
+        memcpy(dst + i, &d, 8);
+    }
+    for (; i < n; ++i) {
+        if (src[i] != 0)
+            dst[i] = src[i];
+    }
+}
 
-#define ERROR_GENERIC "unknown read error"
+#ifdef __SSE2__
+static void blitRowSse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i keep = _mm_cmpeq_epi8(s, zero);
+        d = _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, s));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), d);
+    }
+    blitRowScalar(dst + i, src + i, n - i);
+}
+#endif
 
-static const char xyzMagicNumber[] = {'X', 'Y', 'Z', '1'};
-static const char bmpMagicNumber[] = {'B', 'M'};
+#ifdef BITMAP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void blitRowAvx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        d = _mm256_blendv_epi8(s, d, _mm256_cmpeq_epi8(s, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), d);
+    }
+    blitRowSse2(dst + i, src + i, n - i);
+}
+#endif
 
-/* constructors and destructors */
-Bitmap::Bitmap() :
-    width(0), height(0)
+static BlitRow chooseBlitRow()
 {
+#ifdef BITMAP_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return blitRowAvx2;
+#endif
+#ifdef __SSE2__
+    return blitRowSse2;
+#else
+    return blitRowScalar;
+#endif
 }
 
-Bitmap::Bitmap(const std::string &filename) :
-    width(0), height(0)
+//Repeats each of the n pixels of src factor times into dst
+typedef void (*UpscaleRow)(uint8_t *dst, const uint8_t *src, size_t n, unsigned int factor);
+
+static void upscaleRowScalar(uint8_t *dst, const uint8_t *src, size_t n, unsigned int factor)
 {
-    std::string ext = Util::getExtension(filename);
-    if (ext == "xyz")
-        readFromXyz(filename);
-    else if (ext == "png")
-        readFromPng(filename);
-    else if (ext == "bmp")
-        readFromBmp(filename);
-    else
-        throw std::runtime_error(filename + ": could not determine file type");
+    for (size_t i = 0; i < n; ++i) {
+        for (unsigned int j = 0; j < factor; ++j)
+            *dst++ = src[i];
+    }
 }
 
-Bitmap::Bitmap(unsigned int width, unsigned int height) :
-    width(width), height(height),
-    pixels(width * height)
+#ifdef __SSE2__
+//Doubling is interleaving a vector with itself; quadrupling is doing it twice
+static void upscaleRowSse2(uint8_t *dst, const uint8_t *src, size_t n, unsigned int factor)
 {
+    size_t i = 0;
+    if (factor == 2) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2), _mm_unpacklo_epi8(v, v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2 + 16), _mm_unpackhi_epi8(v, v));
+        }
+    } else if (factor == 4) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i low = _mm_unpacklo_epi8(v, v);
+            __m128i high = _mm_unpackhi_epi8(v, v);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_unpacklo_epi16(low, low));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4 + 16), _mm_unpackhi_epi16(low, low));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4 + 32), _mm_unpacklo_epi16(high, high));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4 + 48), _mm_unpackhi_epi16(high, high));
+        }
+    }
+    upscaleRowScalar(dst + i * factor, src + i, n - i, factor);
 }
+#endif
 
-void Bitmap::readFromXyz(const std::string &filename)
+#ifdef BITMAP_HAVE_AVX2
+//Tripling has no interleave; three byte shuffles spread 16 pixels over 48
+__attribute__((target("ssse3")))
+static void upscaleRowSsse3(uint8_t *dst, const uint8_t *src, size_t n, unsigned int factor)
 {
-    try {
-        char magicNumber[sizeof(xyzMagicNumber)];
-        uLongf size;
-
-        ifstream file(filename.c_str());
-        file.read(magicNumber, 4);
-
-        if (std::memcmp(magicNumber, xyzMagicNumber, sizeof(magicNumber)))
-            throw std::runtime_error("not a valid XYZ file");
-
-        //Read the width and height
-        width = height = 0;
-        file.read(reinterpret_cast<char*>(&width), 2);
-        file.read(reinterpret_cast<char*>(&height), 2);
-
-        //Read the rest into a buffer
-        file.seekg(0, file.end);
-        size = static_cast<uLongf>(file.tellg()) - 8; //8 bytes for header
-        if (size == 0)
-            throw std::runtime_error("not a valid XYZ file");
-        std::vector<Bytef> dataCompressed(size);
-        file.seekg(8, file.beg);
-        file.read(reinterpret_cast<char*>(dataCompressed.data()), dataCompressed.size());
-
-        //Uncompress!
-        size = 256 * 3 + width * height;
-        std::vector<Bytef> data(size);
-        if (uncompress(data.data(), &size, dataCompressed.data(), dataCompressed.size()) != Z_OK)
-            throw std::runtime_error("zlib error");
-        if (size != data.size())
-            throw std::runtime_error("uncompressed image data too small");
-
-        //Copy data to the correct buffers
-        palette = std::vector<uint8_t>(256 * 3);
-        std::copy(data.begin(), data.begin() + 256 * 3, palette.begin());
-        pixels = std::vector<uint8_t>(width * height);
-        std::copy(data.begin() + 256 * 3, data.begin() + 256 * 3 + width * height, pixels.begin());
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(ERROR_GENERIC);
-    } catch (std::runtime_error &e) {
-        throw std::runtime_error(filename + ": " + e.what());
+    if (factor != 3) {
+        upscaleRowSse2(dst, src, n, factor);
+        return;
+    }
+    const __m128i spread0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i spread1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+    const __m128i spread2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm_shuffle_epi8(v, spread0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3 + 16), _mm_shuffle_epi8(v, spread1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3 + 32), _mm_shuffle_epi8(v, spread2));
     }
+    upscaleRowScalar(dst + i * 3, src + i, n - i, 3);
 }
+#endif
 
-void Bitmap::readFromPng(const std::string &filename)
+static UpscaleRow chooseUpscaleRow()
 {
-    std::string error;
+#ifdef BITMAP_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        return upscaleRowSsse3;
+#endif
+#ifdef __SSE2__
+    return upscaleRowSse2;
+#else
+    return upscaleRowScalar;
+#endif
+}
 
-    png_structp png = NULL;
-    png_infop info = NULL;
-    png_bytepp rows = NULL;
+//row enlarged by factor, in buffer unless there is nothing to do
+static const uint8_t *upscaleRow(std::vector<uint8_t> &buffer, const uint8_t *row, size_t n, unsigned int factor)
+{
+    if (factor == 1)
+        return row;
+    static const UpscaleRow upscale = chooseUpscaleRow();
+    buffer.resize(n * factor);
+    upscale(buffer.data(), row, n, factor);
+    return buffer.data();
+}
 
-    FILE *file = Util::fopen(filename, U("rb"));
-    if (!file) {
-        error = "could not open file";
-        goto end;
-    }
+static void requireScale(unsigned int scale)
+{
+    if (scale == 0 || scale > BITMAP_MAX_SCALE)
+        throw std::runtime_error("invalid scale");
+}
 
-    //Check the header
-    png_byte header[8];
-    if (fread(header, 8, 1, file) != 1) {
-        error = "could not validate as PNG";
-        goto end;
-    }
-    if(png_sig_cmp(header, 0, 8) != 0) {
-        error = "not a valid PNG file";
-        goto end;
-    }
+/* constructors and destructors */
+BitmapView::BitmapView() :
+    pixels(NULL), width(0), height(0), stride(0), palette(NULL)
+{
+}
 
-    //Create
-    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL) {
-        error = ERROR_GENERIC;
-        goto end;
+BitmapView::BitmapView(const uint8_t *pixels, unsigned int width, unsigned int height, size_t stride, const std::vector<uint8_t> *palette) :
+    pixels(pixels), width(width), height(height), stride(stride), palette(palette)
+{
+}
+
+const std::vector<uint8_t> &BitmapView::getPalette() const
+{
+    static const std::vector<uint8_t> none;
+    return palette == NULL ? none : *palette;
+}
+
+BitmapView BitmapView::view(int x, int y, int w, int h) const
+{
+    if (x < 0) {
+        w += x;
+        x = 0;
     }
-    info = png_create_info_struct(png);
-    if (info == NULL) {
-        error = ERROR_GENERIC;
-        goto end;
+    if (y < 0) {
+        h += y;
+        y = 0;
     }
+    w = std::min(w, static_cast<int>(width) - x);
+    h = std::min(h, static_cast<int>(height) - y);
+    if (w <= 0 || h <= 0)
+        return BitmapView(NULL, 0, 0, 0, palette);
+    return BitmapView(getRow(y) + x, w, h, stride, palette);
+}
 
-    if (setjmp(png_jmpbuf(png))) {
-        error = ERROR_GENERIC;
-        goto end;
+Bitmap BitmapView::upscale(unsigned int factor) const
+{
+    requireScale(factor);
+    Bitmap scaled(width * factor, height * factor, Bitmap::Undefined);
+    static const UpscaleRow upscale = chooseUpscaleRow();
+    for (unsigned int y = 0; y < height; ++y) {
+        uint8_t *first = scaled.getRow(y * factor);
+        upscale(first, getRow(y), width, factor);
+        for (unsigned int j = 1; j < factor; ++j)
+            memcpy(scaled.getRow(y * factor + j), first, scaled.getWidth());
     }
+    scaled.ownPalette = getPalette();
+    return scaled;
+}
 
-    png_init_io(png, file);
-    png_set_sig_bytes(png, 8);
-    png_read_png(png, info, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING, NULL);
+/* constructors and destructors */
+Bitmap::Bitmap() :
+    data(NULL), capacity(0)
+{
+    palette = &ownPalette;
+}
 
-    //Basic info
-    width = png_get_image_width(png, info);
-    height = png_get_image_height(png, info);
-    if (width == 0 || height == 0) {
-        error = "invalid image dimensions";
-        goto end;
-    }
+Bitmap::Bitmap(const std::string &filename) :
+    data(NULL), capacity(0)
+{
+    palette = &ownPalette;
+    ImageReader image(filename);
+    read(image);
+}
 
-    //Get rows
-    rows = png_get_rows(png, info);
-
-    //Check the colortype
-    switch(png_get_color_type(png, info)) {
-    case PNG_COLOR_TYPE_PALETTE: {
-        //Get palette
-        uint8_t *pngPalette;
-        int nPalette;
-        png_get_PLTE(png, info, reinterpret_cast<png_colorpp>(&pngPalette), &nPalette);
-
-        //Populate palette
-        palette = std::vector<uint8_t>(nPalette * 3);
-        std::copy(pngPalette, pngPalette + nPalette * 3, palette.begin());
-
-        //Populate pixels
-        pixels = std::vector<uint8_t>(width * height);
-        for (unsigned int y = 0; y < height; ++y)
-            std::copy(rows[y], rows[y] + width, pixels.begin() + y * width);
-    } break;
-    default:
-        error = "PNG not indexed";
-        goto end;
-    }
-end:
-    if (png != NULL || info != NULL) {
-        png_free_data(png, info, PNG_FREE_ALL, -1);
-        png_destroy_read_struct(&png, &info, NULL);
-    }
-    if (file)
-        fclose(file);
+Bitmap::Bitmap(ImageReader &image) :
+    data(NULL), capacity(0)
+{
+    palette = &ownPalette;
+    read(image);
+}
 
-    if (!error.empty())
-        throw std::runtime_error(filename + ": " + error);
+Bitmap::Bitmap(unsigned int width, unsigned int height, Contents contents) :
+    data(NULL), capacity(0)
+{
+    palette = &ownPalette;
+    allocate(width, height, contents);
 }
 
-void Bitmap::readFromBmp(const std::string &filename)
+Bitmap::Bitmap(const Bitmap &other) :
+    BitmapView(),
+    data(NULL), capacity(0),
+    ownPalette(other.getPalette())
 {
-    try {
-        char magicNumber[sizeof(bmpMagicNumber)];
-        int32_t temp;
-
-        ifstream file(filename.c_str());
-
-        //Read and verify magic number
-        file.read(magicNumber, sizeof(magicNumber));
-        if (std::memcmp(magicNumber, bmpMagicNumber, sizeof(magicNumber)))
-            throw std::runtime_error("not a valid BMP file");
-
-        //Read: pixel data offset, palette offset
-        file.seekg(10);
-        uint32_t pixelOffset;
-        file.read(reinterpret_cast<char*>(&pixelOffset), 4);
-        uint32_t paletteOffset;
-        file.read(reinterpret_cast<char*>(&paletteOffset), 4);
-        paletteOffset += 14;
-
-        //Read: width, height, pixel order; basic sanity checking
-        width = 0;
-        file.read(reinterpret_cast<char*>(&width), 4);
-        file.read(reinterpret_cast<char*>(&temp), 4);
-        if (width == 0 || temp == 0)
-            throw std::runtime_error("invalid image dimensions");
-        bool topDown = temp < 0;
-        height = abs(temp);
-
-        //More sanity checking
-        temp = 0;
-        file.read(reinterpret_cast<char*>(&temp), 2);
-        if (temp != 1)
-            throw std::runtime_error("number of BMP planes is not 1");
-        file.read(reinterpret_cast<char*>(&temp), 2);
-        if (temp != 8)
-            throw std::runtime_error("BMP is not 8-bit");
-        file.read(reinterpret_cast<char*>(&temp), 4);
-        if (temp != 0)
-            throw std::runtime_error("BMP is compressed");
-
-        //Read palette info
-        file.seekg(14 + 32);
-        uint32_t nPalette;
-        file.read(reinterpret_cast<char*>(&nPalette), 4);
-        if (nPalette > 256)
-            throw std::runtime_error("BMP header specifies more than 256 colors");
-        if (nPalette == 0)
-            nPalette = 256;
-
-        //Read palette
-        std::vector<uint8_t> bmpPalette(nPalette * 4);
-        file.seekg(paletteOffset);
-        file.read(reinterpret_cast<char*>(bmpPalette.data()), bmpPalette.size());
-
-        //Read pixels
-        std::vector<uint8_t> bmpPixels(width * height);
-        file.seekg(pixelOffset);
-        file.read(reinterpret_cast<char*>(bmpPixels.data()), bmpPixels.size());
-
-        //Populate palette
-        palette = std::vector<uint8_t>(nPalette * 3);
-        for (unsigned int i = 0; i < nPalette; ++i) {
-            palette[i * 3 + 0] = bmpPalette[i * 4 + 2];
-            palette[i * 3 + 1] = bmpPalette[i * 4 + 1];
-            palette[i * 3 + 2] = bmpPalette[i * 4 + 0];
-        }
+    palette = &ownPalette;
+    allocate(other.width, other.height, Undefined);
+    for (unsigned int y = 0; y < height; ++y)
+        memcpy(getRow(y), other.getRow(y), width);
+}
 
-        //Populate pixels
-        pixels = std::vector<uint8_t>(width * height);
-        for (unsigned int y = 0; y < height; ++y) {
-            int offset = (topDown ? y : height - 1 - y) * width;
-            std::copy(bmpPixels.begin() + offset, bmpPixels.begin() + offset + width, pixels.begin() + y * width);
-        }
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(filename + ": " + ERROR_GENERIC);
-    } catch (std::runtime_error &e) {
-        throw std::runtime_error(filename + ": " + e.what());
-    }
+Bitmap::Bitmap(Bitmap &&other) :
+    BitmapView(),
+    data(NULL), capacity(0)
+{
+    palette = &ownPalette;
+    swap(other);
 }
 
-void Bitmap::blit(int mX, int mY, const Bitmap &other, int oX, int oY, int oW, int oH)
+Bitmap::~Bitmap()
 {
-    for (int y = 0; y < oH; ++y) {
-        for (int x = 0; x < oW; ++x) {
-            int oOffset = (oY + y) * other.width + oX + x;
-            int mOffset = (mY + y) * width + mX + x;
-            if (other.pixels[oOffset] != 0)
-                pixels[mOffset] = other.pixels[oOffset];
-        }
+    BufferPool::get().release(data, capacity);
+}
+
+Bitmap &Bitmap::operator=(const Bitmap &other)
+{
+    if (&other != this) {
+        Bitmap copy(other);
+        swap(copy);
     }
+    return *this;
 }
 
-void Bitmap::writeToXyz(const std::string &filename, const std::vector<uint8_t> &palette) const
+Bitmap &Bitmap::operator=(Bitmap &&other)
 {
-    try {
-        uLongf size;
-
-        ofstream file(filename.c_str());
-        file.write(xyzMagicNumber, 4);
-
-        //Write the width and height
-        file.write(reinterpret_cast<const char*>(&width), 2);
-        file.write(reinterpret_cast<const char*>(&height), 2);
-
-        //Create a buffer to compress
-        std::vector<Bytef> data(256*3 + width * height);
-        std::copy(palette.begin(), palette.end(), data.begin());
-        std::fill(data.begin() + palette.size(), data.begin() + 256 * 3, 0);
-        std::copy(pixels.begin(), pixels.end(), data.begin() + 256 * 3);
-
-        //Create a compressed buffer, compress it
-        size = compressBound(256 * 3 + width * height);
-        std::vector<Bytef> dataCompressed(size);
-        if (compress(dataCompressed.data(), &size, data.data(), data.size()) != Z_OK)
-            throw std::runtime_error("zlib error");
-
-        //Write to file
-        file.write(reinterpret_cast<const char*>(dataCompressed.data()), size);
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(ERROR_GENERIC);
-    } catch (std::runtime_error &e) {
-        throw std::runtime_error(filename + ": " + e.what());
+    if (&other != this) {
+        Bitmap moved(std::move(other));
+        swap(moved);
     }
+    return *this;
 }
 
-void Bitmap::writeToPng(const std::string &filename, bool transparent, const std::vector<uint8_t> &palette) const
+//Fresh storage with every row aligned; any previous pixels are gone
+void Bitmap::allocate(unsigned int width, unsigned int height, Contents contents)
 {
-    volatile bool failed = false;
+    size_t newStride = (width + BITMAP_ALIGNMENT - 1) / BITMAP_ALIGNMENT * BITMAP_ALIGNMENT;
+    BufferPool::get().release(data, capacity);
+    data = NULL;
+    capacity = 0;
+    if (newStride * height > 0)
+        data = BufferPool::get().acquire(newStride * height, contents == Cleared, capacity);
+
+    pixels = data;
+    this->width = width;
+    this->height = height;
+    stride = newStride;
+}
 
-    //Transparent color index
-    png_byte trans = 0;
+//Exchanges pixels and palettes; each keeps pointing at its own palette
+void Bitmap::swap(Bitmap &other)
+{
+    std::swap(data, other.data);
+    std::swap(capacity, other.capacity);
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    std::swap(stride, other.stride);
+    ownPalette.swap(other.ownPalette);
+    pixels = data;
+    other.pixels = other.data;
+}
 
-    png_structp png = NULL;
-    png_infop info = NULL;
+static void requireIndexed(const ImageReader &image, bool orTruecolor = false)
+{
+    if (image.getFormat() == ImageReader::Unknown)
+        throw std::runtime_error(image.getFilename() + ": could not determine file type");
+    if (!image.isIndexed() && !(orTruecolor && image.isTruecolor()))
+        throw std::runtime_error(image.getFilename() + ": image is not indexed");
+}
 
-    //Open file for writing
-    FILE *file = Util::fopen(filename, U("wb"));
-    if (!file) {
-        failed = true;
-        goto end;
+bool Bitmap::read(ImageReader &image)
+{
+    requireIndexed(image, true);
+
+    if (image.isTruecolor()) {
+        //Decode as RGBA and pick a palette for it
+        RgbaBitmap rgba(image.getWidth(), image.getHeight());
+        if (!rgba.empty())
+            image.readImage(rgba.getRow(0), rgba.getStride());
+        Quantizer quantizer(rgba);
+        Bitmap quantized(image.getWidth(), image.getHeight(), Undefined);
+        for (unsigned int y = 0; y < quantized.height; ++y)
+            quantizer.apply(quantized.getRow(y), rgba.getRow(y), quantized.width);
+        swap(quantized);
+        ownPalette = quantizer.getPalette();
+        return quantizer.isExact();
     }
 
-    //Initialize write structure
-    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL) {
-        failed = true;
-        goto end;
-    }
+    //Decode straight into our own storage; every row gets overwritten
+    Bitmap decoded(image.getWidth(), image.getHeight(), Undefined);
+    if (!decoded.empty())
+        image.readImage(decoded.data, decoded.stride);
+    swap(decoded);
+    ownPalette = image.getPalette();
+    return true;
+}
 
-    //Initialize info structure
-    info = png_create_info_struct(png);
-    if (info == NULL) {
-        failed = true;
-        goto end;
+void Bitmap::blit(int mX, int mY, const BitmapView &other, int oX, int oY, int oW, int oH, BlitMode mode)
+{
+    if (data != NULL && other.getRow(0) >= data && other.getRow(0) < data + stride * height) {
+        //A view of ourselves; rows may overlap, so blit from a snapshot
+        Bitmap copy(other.getWidth(), other.getHeight(), Undefined);
+        copy.blit(0, 0, other, 0, 0, other.getWidth(), other.getHeight(), Opaque);
+        blit(mX, mY, copy, oX, oY, oW, oH, mode);
+        return;
     }
 
-    //Setup Exception handling
-    if (setjmp(png_jmpbuf(png))) {
-        failed = true;
-        goto end;
+    if (!clipBlit(mX, mY, oX, oY, oW, oH, other.getWidth(), other.getHeight(), width, height))
+        return;
+
+    const uint8_t *src = other.getRow(oY) + oX;
+    uint8_t *dst = getRow(mY) + mX;
+    if (mode == Opaque) {
+        for (int y = 0; y < oH; ++y, src += other.getStride(), dst += stride)
+            memcpy(dst, src, oW);
+    } else {
+        static const BlitRow blitRow = chooseBlitRow();
+        for (int y = 0; y < oH; ++y, src += other.getStride(), dst += stride)
+            blitRow(dst, src, oW);
     }
+}
 
-    png_init_io(png, file);
+void Bitmap::blit(int mX, int mY, const BitmapView &other, int oX, int oY, int oW, int oH, const PaletteRemap &remap, BlitMode mode)
+{
+    if (remap.isIdentity()) {
+        blit(mX, mY, other, oX, oY, oW, oH, mode);
+        return;
+    }
 
-    //Write header
-    png_set_IHDR(png, info, width, height,
-                 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_set_PLTE(png, info, reinterpret_cast<const png_color*>(palette.data()), palette.size() / 3);
-    if (transparent)
-        png_set_tRNS(png, info, &trans, 1, NULL);
-    png_write_info(png, info);
+    //Remap the source rectangle, then blit that as usual
+    BitmapView source = other.view(oX, oY, oW, oH);
+    mX += std::max(0, -oX);
+    mY += std::max(0, -oY);
+    Bitmap remapped(source.getWidth(), source.getHeight(), Undefined);
+    for (unsigned int y = 0; y < source.getHeight(); ++y)
+        remap.apply(remapped.getRow(y), source.getRow(y), source.getWidth());
+    blit(mX, mY, remapped, 0, 0, remapped.getWidth(), remapped.getHeight(), mode);
+}
 
-    //Write image data
+void Bitmap::remap(const PaletteRemap &remap)
+{
     for (unsigned int y = 0; y < height; ++y)
-        png_write_row(png, pixels.data() + y * width);
-
-    //End
-    png_write_end(png, info);
+        remap.apply(getRow(y), getRow(y), width);
+    //The default identity remap has no palette to take on
+    if (!remap.getPalette().empty())
+        ownPalette = remap.getPalette();
+}
 
-end:
-    if (png || info) {
-        png_free_data(png, info, PNG_FREE_ALL, -1);
-        png_destroy_write_struct(&png, &info);
-    }
-    if (file)
-        fclose(file);
-    if (failed)
-        throw std::runtime_error("unknown error while writing PNG");
+void BitmapView::writeToXyz(const std::string &filename, const std::vector<uint8_t> &palette, unsigned int scale) const
+{
+    writeAndClose(openForWriting(filename), filename,
+                  [&](FILE *file) { writeToXyz(file, palette, scale); });
 }
 
-bool Bitmap::isIndexed(const std::string &filename)
+void BitmapView::writeToXyz(OutputTree &tree, const std::string &filename, const std::vector<uint8_t> &palette, unsigned int scale) const
 {
-    std::string ext = Util::getExtension(filename);
-    if (ext == "png") {
-        volatile bool success = true;
+    writeAndClose(tree.create(filename), tree.getRoot() + filename,
+                  [&](FILE *file) { writeToXyz(file, palette, scale); });
+}
 
-        png_structp png = NULL;
-        png_infop info = NULL;
+void BitmapView::writeToXyz(FILE *file, const std::vector<uint8_t> &palette, unsigned int scale) const
+{
+    requireScale(scale);
+    XyzWriter xyz(file, width * scale, height * scale);
+    xyz.writePalette(palette);
+    std::vector<uint8_t> scaled;
+    for (unsigned int y = 0; y < height; ++y) {
+        const uint8_t *row = upscaleRow(scaled, getRow(y), width, scale);
+        for (unsigned int j = 0; j < scale; ++j)
+            xyz.write(row, width * scale);
+    }
+    xyz.finish();
+}
 
-        int width, height;
+void BitmapView::writeToPng(const std::string &filename, bool transparent, const std::vector<uint8_t> &palette, unsigned int scale) const
+{
+    writeAndClose(openForWriting(filename), filename,
+                  [&](FILE *file) { writeToPng(file, transparent, palette, scale); });
+}
 
-        FILE *file = Util::fopen(filename, U("rb"));
-        if (!file) {
-            success = false;
-            goto end;
-        }
+void BitmapView::writeToPng(OutputTree &tree, const std::string &filename, bool transparent, const std::vector<uint8_t> &palette, unsigned int scale) const
+{
+    writeAndClose(tree.create(filename), tree.getRoot() + filename,
+                  [&](FILE *file) { writeToPng(file, transparent, palette, scale); });
+}
 
-        //Check the header
-        png_byte header[8];
-        if (fread(header, 8, 1, file) != 1) {
-            success = false;
-            goto end;
+//Counts how often each index occurs in one row. Runs of 16 equal pixels,
+//common in tile layers, are counted in one go; the rest is spread over four
+//tables (banks, 4 * 256 entries) so that repeated indices do not wait on each
+//other.
+static void countRow(const uint8_t *pixels, size_t n, uint32_t *banks)
+{
+    uint32_t *bank0 = &banks[0], *bank1 = &banks[256], *bank2 = &banks[512], *bank3 = &banks[768];
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(pixels[i]))) == 0xFFFF) {
+            bank0[pixels[i]] += 16;
+            continue;
         }
-        if(png_sig_cmp(header, 0, 8) != 0) {
-            success = false;
-            goto end;
+        for (unsigned int j = 0; j < 16; j += 4) {
+            ++bank0[pixels[i + j]];
+            ++bank1[pixels[i + j + 1]];
+            ++bank2[pixels[i + j + 2]];
+            ++bank3[pixels[i + j + 3]];
         }
+    }
+#endif
+    for (; i + 4 <= n; i += 4) {
+        ++bank0[pixels[i]];
+        ++bank1[pixels[i + 1]];
+        ++bank2[pixels[i + 2]];
+        ++bank3[pixels[i + 3]];
+    }
+    for (; i < n; ++i)
+        ++bank0[pixels[i]];
+}
 
-        //Create
-        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        if (png == NULL) {
-            success = false;
-            goto end;
-        }
-        info = png_create_info_struct(png);
-        if (info == NULL) {
-            success = false;
-            goto end;
+void BitmapView::countIndices(uint32_t counts[256]) const
+{
+    std::vector<uint32_t> banks(4 * 256);
+    for (unsigned int y = 0; y < height; ++y)
+        countRow(getRow(y), width, banks.data());
+    for (unsigned int c = 0; c < 256; ++c)
+        counts[c] = banks[c] + banks[256 + c] + banks[512 + c] + banks[768 + c];
+}
+
+uint64_t BitmapView::contentHash(const std::vector<uint8_t> &palette) const
+{
+    //Same compaction as writeToPng, except that an unused index 0 goes too
+    uint32_t counts[256];
+    countIndices(counts);
+    uint8_t remap[256];
+    std::vector<uint8_t> compact;
+    unsigned int used = 0;
+    bool identity = true;
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (counts[i] == 0)
+            continue;
+        identity = identity && used == i;
+        remap[i] = used++;
+        for (unsigned int c = 0; c < 3; ++c)
+            compact.push_back(i * 3 + c < palette.size() ? palette[i * 3 + c] : 0);
+    }
+
+    //Header: little-endian size, then whether the first color is the key
+    uint8_t header[9];
+    for (unsigned int i = 0; i < 4; ++i) {
+        header[i] = static_cast<uint8_t>(width >> (i * 8));
+        header[4 + i] = static_cast<uint8_t>(height >> (i * 8));
+    }
+    header[8] = counts[0] > 0;
+
+    ContentHash hash;
+    hash.update(header, sizeof(header));
+    hash.update(compact.data(), compact.size());
+    std::vector<uint8_t> row(identity ? 0 : width);
+    for (unsigned int y = 0; y < height; ++y) {
+        const uint8_t *src = getRow(y);
+        if (!identity) {
+            for (unsigned int x = 0; x < width; ++x)
+                row[x] = remap[src[x]];
+            src = row.data();
         }
+        hash.update(src, width);
+    }
+    return hash.digest();
+}
 
-        if (setjmp(png_jmpbuf(png))) {
-            success = false;
-            goto end;
+void BitmapView::writeToPng(FILE *file, bool transparent, const std::vector<uint8_t> &palette, unsigned int scale) const
+{
+    //Keep only the colors in use, in their original order and with index 0
+    //kept as the transparent one, so the image may fit in fewer bits per pixel
+    requireScale(scale);
+    uint32_t counts[256];
+    countIndices(counts);
+    uint8_t remap[256];
+    std::vector<uint8_t> compact;
+    unsigned int used = 0;
+    bool identity = true;
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (counts[i] == 0 && !(transparent && i == 0))
+            continue;
+        identity = identity && used == i;
+        remap[i] = used++;
+        for (unsigned int c = 0; c < 3; ++c)
+            compact.push_back(i * 3 + c < palette.size() ? palette[i * 3 + c] : 0);
+    }
+    unsigned int bitDepth = used <= 2 ? 1 : used <= 4 ? 2 : used <= 16 ? 4 : 8;
+
+    PngWriter png(file, width * scale, height * scale, compact, transparent, bitDepth);
+    std::vector<uint8_t> row(identity ? 0 : width);
+    std::vector<uint8_t> scaled;
+    for (unsigned int y = 0; y < height; ++y) {
+        const uint8_t *src = getRow(y);
+        if (!identity) {
+            for (unsigned int x = 0; x < width; ++x)
+                row[x] = remap[src[x]];
+            src = row.data();
         }
+        src = upscaleRow(scaled, src, width, scale);
+        for (unsigned int j = 0; j < scale; ++j)
+            png.writeRow(src);
+    }
+    png.finish();
+}
+
+//Runs transcode into a freshly opened file and closes it. Unlike a Bitmap, the
+//source is only validated while writing, so a failed output is deleted again;
+//transcode names the source in its own errors.
+template <typename Transcode>
+static void transcodeAndClose(FILE *file, const std::string &filename, Transcode transcode)
+{
+    try {
+        transcode(file);
+    } catch (...) {
+        fclose(file);
+        Util::deleteFile(filename);
+        throw;
+    }
+    if (fclose(file) != 0)
+        throw std::runtime_error(filename + ": " + ERROR_WRITE);
+}
 
-        png_init_io(png, file);
-        png_set_sig_bytes(png, 8);
-        png_read_info(png, info);
+void Bitmap::transcodeToPng(ImageReader &src, const std::string &dst, bool transparent, unsigned int scale)
+{
+    transcodeAndClose(openForWriting(dst), dst,
+                      [&](FILE *file) { transcodeToPng(src, file, transparent, scale); });
+}
 
-        //Basic info
-        width = png_get_image_width(png, info);
-        height = png_get_image_height(png, info);
-        if (width == 0 || height == 0) {
-            success = false;
-            goto end;
-        }
+void Bitmap::transcodeToPng(ImageReader &src, OutputTree &tree, const std::string &dst, bool transparent, unsigned int scale)
+{
+    transcodeAndClose(tree.create(dst), tree.getRoot() + dst,
+                      [&](FILE *file) { transcodeToPng(src, file, transparent, scale); });
+}
 
-        if (png_get_color_type(png, info) != PNG_COLOR_TYPE_PALETTE) {
-            success = false;
-            goto end;
+void Bitmap::transcodeToPng(ImageReader &src, FILE *dst, bool transparent, unsigned int scale)
+{
+    requireIndexed(src);
+
+    //Rows go from the decoder to the PNG encoder one at a time
+    std::vector<uint8_t> row(src.getWidth());
+    std::vector<uint8_t> scaled;
+    try {
+        requireScale(scale);
+        PngWriter png(dst, src.getWidth() * scale, src.getHeight() * scale, src.getPalette(), transparent);
+        for (unsigned int y = 0; y < src.getHeight(); ++y) {
+            src.readRow(row.data());
+            const uint8_t *out = upscaleRow(scaled, row.data(), row.size(), scale);
+            for (unsigned int j = 0; j < scale; ++j)
+                png.writeRow(out);
         }
-    end:
-        if (png != NULL || info != NULL) {
-            png_free_data(png, info, PNG_FREE_ALL, -1);
-            png_destroy_read_struct(&png, &info, NULL);
+        png.finish();
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error(src.getFilename() + ": " + e.what());
+    }
+}
+
+void Bitmap::transcodeToXyz(ImageReader &src, const std::string &dst, unsigned int scale)
+{
+    transcodeAndClose(openForWriting(dst), dst,
+                      [&](FILE *file) { transcodeToXyz(src, file, scale); });
+}
+
+void Bitmap::transcodeToXyz(ImageReader &src, OutputTree &tree, const std::string &dst, unsigned int scale)
+{
+    transcodeAndClose(tree.create(dst), tree.getRoot() + dst,
+                      [&](FILE *file) { transcodeToXyz(src, file, scale); });
+}
+
+void Bitmap::transcodeToXyz(ImageReader &src, FILE *dst, unsigned int scale)
+{
+    requireIndexed(src, true);
+
+    //Rows go from the decoder to the deflater one at a time
+    std::vector<uint8_t> row(src.getWidth());
+    std::vector<uint8_t> scaled;
+    try {
+        requireScale(scale);
+        if (src.isTruecolor()) {
+            //The palette depends on every pixel, so this one is decoded whole
+            Bitmap quantized(src);
+            quantized.writeToXyz(dst, quantized.getPalette(), scale);
+            return;
         }
-        if (file)
-            fclose(file);
-        return success;
-    } else if (ext == "bmp") {
-        try {
-            char magicNumber[sizeof(bmpMagicNumber)];
-
-            ifstream file(filename.c_str());
-
-            //Read and verify magic number
-            file.read(magicNumber, sizeof(magicNumber));
-            if (std::memcmp(magicNumber, bmpMagicNumber, sizeof(magicNumber)))
-                return false;
-
-            //Read: width, height, pixel order; basic sanity checking
-            file.seekg(18);
-            int32_t width = 0, height = 0;
-            file.read(reinterpret_cast<char*>(&width), 4);
-            file.read(reinterpret_cast<char*>(&height), 4);
-            if (width == 0 || height == 0)
-                return false;
-
-            //More sanity checking
-            int32_t temp = 0;
-            file.read(reinterpret_cast<char*>(&temp), 2);
-            if (temp != 1)
-                return false;
-            file.read(reinterpret_cast<char*>(&temp), 2);
-            if (temp != 8)
-                return false;
-            file.read(reinterpret_cast<char*>(&temp), 4);
-            if (temp != 0)
-                return false;
-            return true;
-        } catch (ifstream::failure &e) {
-            return false;
+        XyzWriter xyz(dst, src.getWidth() * scale, src.getHeight() * scale);
+        xyz.writePalette(src.getPalette());
+        for (unsigned int y = 0; y < src.getHeight(); ++y) {
+            src.readRow(row.data());
+            const uint8_t *out = upscaleRow(scaled, row.data(), row.size(), scale);
+            for (unsigned int j = 0; j < scale; ++j)
+                xyz.write(out, row.size() * scale);
         }
+        xyz.finish();
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error(src.getFilename() + ": " + e.what());
     }
-
-    return false;
 }
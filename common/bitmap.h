@@ -3,46 +3,148 @@
 
 #include <stdint.h>
 
+#include <cstdio>
+
 #include <string>
 #include <vector>
 
-class Bitmap
+class OutputTree;
+class ImageReader;
+class PaletteRemap;
+class Bitmap;
+
+#define BITMAP_ALIGNMENT 64
+#define BITMAP_MAX_SCALE 8
+
+//A rectangle of indexed pixels owned by someone else (usually a Bitmap), rows
+//stride bytes apart. Views are cheap to copy and only valid as long as the
+//pixels and palette they point to.
+class BitmapView
 {
 public:
     /* constructors and destructors */
-    Bitmap();
-    Bitmap(const std::string &filename);
-    Bitmap(unsigned int width, unsigned int height);
+    BitmapView();
+    BitmapView(const uint8_t *pixels, unsigned int width, unsigned int height, size_t stride, const std::vector<uint8_t> *palette);
 
     //Accessors
     unsigned int getWidth() const { return width; }
     unsigned int getHeight() const { return height; }
-    const std::vector<uint8_t> &getPixels() const { return pixels; }
-    const std::vector<uint8_t> &getPalette() const { return palette; }
+    size_t getStride() const { return stride; }
+    const uint8_t *getRow(unsigned int y) const { return pixels + y * stride; }
+    const std::vector<uint8_t> &getPalette() const;
+
+    //A window into this view, clipped to it; no pixels are copied
+    BitmapView view(int x, int y, int w, int h) const;
+
+    //How often each index occurs
+    void countIndices(uint32_t counts[256]) const;
 
-    //Blit!
-    void blit(int mX, int mY, const Bitmap &other, int oX, int oY, int oW, int oH);
+    //64-bit hash of what the image looks like, whatever file it came from:
+    //the size, the colors actually used (in index order, index 0 counting as
+    //the transparent key) and the pixels. Unused palette entries and the
+    //stride do not count, so an XYZ and the compacted PNG written from it
+    //hash the same.
+    uint64_t contentHash(const std::vector<uint8_t> &palette) const;
+    uint64_t contentHash() const { return contentHash(getPalette()); }
 
-   	//Read from file
-    void readFromXyz(const std::string &filename);
-    void readFromPng(const std::string &filename);
-    void readFromBmp(const std::string &filename);
+    //Copy enlarged by a whole factor, every pixel repeated factor times
+    //across and down
+    Bitmap upscale(unsigned int factor) const;
 
-    //Write to file
-    void writeToPng(const std::string &filename, bool transparent, const std::vector<uint8_t> &palette) const;
-    void writeToXyz(const std::string &filename, const std::vector<uint8_t> &palette) const;
-    void writeToPng(const std::string &filename, bool transparent) const { writeToPng(filename, transparent, palette); }
-    void writeToXyz(const std::string &filename) const { writeToXyz(filename, palette); }
+    //Write to file, optionally enlarged by a whole factor as with upscale().
+    //PNGs only get the colors actually used, at the lowest bit depth that
+    //holds them.
+    void writeToPng(const std::string &filename, bool transparent, const std::vector<uint8_t> &palette, unsigned int scale = 1) const;
+    void writeToXyz(const std::string &filename, const std::vector<uint8_t> &palette, unsigned int scale = 1) const;
+    void writeToPng(const std::string &filename, bool transparent) const { writeToPng(filename, transparent, getPalette()); }
+    void writeToXyz(const std::string &filename) const { writeToXyz(filename, getPalette()); }
+    void writeToPng(OutputTree &tree, const std::string &filename, bool transparent, const std::vector<uint8_t> &palette, unsigned int scale = 1) const;
+    void writeToXyz(OutputTree &tree, const std::string &filename, const std::vector<uint8_t> &palette, unsigned int scale = 1) const;
+    void writeToPng(OutputTree &tree, const std::string &filename, bool transparent) const { writeToPng(tree, filename, transparent, getPalette()); }
+    void writeToXyz(OutputTree &tree, const std::string &filename) const { writeToXyz(tree, filename, getPalette()); }
+    //Write to an open file, which the caller closes
+    void writeToPng(FILE *file, bool transparent, const std::vector<uint8_t> &palette, unsigned int scale = 1) const;
+    void writeToXyz(FILE *file, const std::vector<uint8_t> &palette, unsigned int scale = 1) const;
+    void writeToPng(FILE *file, bool transparent) const { writeToPng(file, transparent, getPalette()); }
+    void writeToXyz(FILE *file) const { writeToXyz(file, getPalette()); }
 
     bool empty() const { return width == 0 || height == 0; }
 
-    static bool isIndexed(const std::string &filename);
+protected:
+    const uint8_t *pixels;
+    unsigned int width, height;
+    size_t stride;
+    const std::vector<uint8_t> *palette;
+};
+
+//An indexed image. Every row starts on a cache line (BITMAP_ALIGNMENT), so
+//rows are stride bytes apart rather than width. Pixel storage comes from the
+//shared BufferPool, so bitmaps of similar size made one after another reuse
+//the same memory.
+class Bitmap : public BitmapView
+{
+public:
+    enum Contents {
+        Cleared,   //every pixel is index 0
+        Undefined, //the caller overwrites every row before reading any
+    };
+
+    /* constructors and destructors */
+    Bitmap();
+    //Reads any supported format, recognized by its contents; truecolor
+    //images are reduced to 256 colors by a Quantizer
+    Bitmap(const std::string &filename);
+    explicit Bitmap(ImageReader &image);
+    Bitmap(unsigned int width, unsigned int height, Contents contents = Cleared);
+    Bitmap(const Bitmap &other);
+    Bitmap(Bitmap &&other);
+    ~Bitmap();
+    Bitmap &operator=(const Bitmap &other);
+    Bitmap &operator=(Bitmap &&other);
+
+    //Accessors
+    uint8_t *getRow(unsigned int y) { return data + y * stride; }
+    const uint8_t *getRow(unsigned int y) const { return pixels + y * stride; }
+
+    enum BlitMode {
+        Transparent, //index 0 in other is skipped
+        Opaque,      //copied as is
+    };
+
+    //Blit! The rectangle is clipped to both bitmaps.
+    void blit(int mX, int mY, const BitmapView &other, int oX, int oY, int oW, int oH, BlitMode mode = Transparent);
+    //Same, translating the indices of other on the way; Transparent skips
+    //what ends up as index 0
+    void blit(int mX, int mY, const BitmapView &other, int oX, int oY, int oW, int oH, const PaletteRemap &remap, BlitMode mode = Transparent);
+
+    //Translates every pixel in place and takes on the target palette, if
+    //remap has one
+    void remap(const PaletteRemap &remap);
+
+    //Decode an opened image into this bitmap. Returns false if colors were
+    //lost, which only happens to truecolor images with more than 255 opaque
+    //colors.
+    bool read(ImageReader &image);
+
+    //Convert an opened image to PNG or XYZ a row at a time, without decoding
+    //the whole image (except truecolor ones, which are quantized first);
+    //optionally enlarged on the way, as with upscale()
+    static void transcodeToPng(ImageReader &src, const std::string &dst, bool transparent, unsigned int scale = 1);
+    static void transcodeToXyz(ImageReader &src, const std::string &dst, unsigned int scale = 1);
+    static void transcodeToPng(ImageReader &src, OutputTree &tree, const std::string &dst, bool transparent, unsigned int scale = 1);
+    static void transcodeToXyz(ImageReader &src, OutputTree &tree, const std::string &dst, unsigned int scale = 1);
+    static void transcodeToPng(ImageReader &src, FILE *dst, bool transparent, unsigned int scale = 1);
+    static void transcodeToXyz(ImageReader &src, FILE *dst, unsigned int scale = 1);
 
 private:
-    unsigned int width, height;
-    std::vector<uint8_t> pixels;
-    std::vector<uint8_t> palette;
+    friend class BitmapView;
+
+    void allocate(unsigned int width, unsigned int height, Contents contents);
+    void swap(Bitmap &other);
+
+    uint8_t *data;
+    size_t capacity; //as handed out by the BufferPool
+    std::vector<uint8_t> ownPalette;
 };
 
 #endif // BITMAP_H
-
@@ -0,0 +1,145 @@
+#include "bufferpool.h"
+
+#include <new>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "os.h"
+
+#if defined OS_W32
+#include <malloc.h>
+#endif
+
+/* constructors and destructors */
+BufferPool::BufferPool()
+{
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+BufferPool &BufferPool::get()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+uint8_t *BufferPool::acquire(size_t size, bool zero, size_t &capacity)
+{
+    //Find the size class
+    unsigned int sizeClass = 0;
+    capacity = BUFFERPOOL_MIN_SIZE;
+    while (capacity < size && sizeClass < BUFFERPOOL_CLASSES) {
+        capacity *= 2;
+        ++sizeClass;
+    }
+
+    if (sizeClass == BUFFERPOOL_CLASSES) {
+        //Too big to be worth keeping around
+        capacity = size;
+    }
+
+    uint8_t *buffer = NULL;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++stats.allocations;
+        if (sizeClass < BUFFERPOOL_CLASSES && !freeLists[sizeClass].empty()) {
+            buffer = freeLists[sizeClass].back();
+            freeLists[sizeClass].pop_back();
+            stats.cachedBytes -= capacity;
+            ++stats.reused;
+        }
+        stats.liveBytes += capacity;
+        if (stats.liveBytes > stats.peakBytes)
+            stats.peakBytes = stats.liveBytes;
+    }
+
+    if (buffer == NULL) {
+        buffer = allocate(capacity);
+        if (buffer == NULL) {
+            std::unique_lock<std::mutex> lock(mutex);
+            stats.liveBytes -= capacity;
+            throw std::bad_alloc();
+        }
+    }
+    if (zero)
+        std::memset(buffer, 0, size);
+    return buffer;
+}
+
+void BufferPool::release(uint8_t *buffer, size_t capacity)
+{
+    if (buffer == NULL)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stats.liveBytes -= capacity;
+        if (capacity >= BUFFERPOOL_MIN_SIZE && (capacity & (capacity - 1)) == 0
+                && stats.cachedBytes + capacity <= BUFFERPOOL_MAX_CACHED) {
+            unsigned int sizeClass = 0;
+            while ((static_cast<size_t>(BUFFERPOOL_MIN_SIZE) << sizeClass) < capacity)
+                ++sizeClass;
+            if (sizeClass < BUFFERPOOL_CLASSES) {
+                freeLists[sizeClass].push_back(buffer);
+                stats.cachedBytes += capacity;
+                return;
+            }
+        }
+    }
+    free(buffer);
+}
+
+BufferPool::Stats BufferPool::getStats() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return stats;
+}
+
+void BufferPool::trim()
+{
+    std::vector<uint8_t*> buffers;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (unsigned int i = 0; i < BUFFERPOOL_CLASSES; ++i) {
+            buffers.insert(buffers.end(), freeLists[i].begin(), freeLists[i].end());
+            freeLists[i].clear();
+        }
+        stats.cachedBytes = 0;
+    }
+    for (unsigned int i = 0; i < buffers.size(); ++i)
+        free(buffers[i]);
+}
+
+#if defined OS_W32
+
+uint8_t *BufferPool::allocate(size_t size)
+{
+    return static_cast<uint8_t*>(_aligned_malloc(size, BUFFERPOOL_ALIGNMENT));
+}
+
+void BufferPool::free(uint8_t *buffer)
+{
+    _aligned_free(buffer);
+}
+
+#elif defined OS_UNIX
+
+uint8_t *BufferPool::allocate(size_t size)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, BUFFERPOOL_ALIGNMENT, size) != 0)
+        return NULL;
+    return static_cast<uint8_t*>(buffer);
+}
+
+void BufferPool::free(uint8_t *buffer)
+{
+    std::free(buffer);
+}
+
+#endif
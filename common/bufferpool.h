@@ -0,0 +1,61 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stdint.h>
+
+#include <cstddef>
+
+#include <mutex>
+#include <vector>
+
+#define BUFFERPOOL_ALIGNMENT 64
+#define BUFFERPOOL_MIN_SIZE (4 * 1024)
+#define BUFFERPOOL_CLASSES 14 //4K up to 32M
+#define BUFFERPOOL_MAX_CACHED (64 * 1024 * 1024)
+
+//Recycles large, cache-line aligned buffers. Sizes are rounded up to a power
+//of two, and released buffers wait in a free list per size so the next
+//request of that size skips the allocator (and, if asked to, the memset).
+//Buffers beyond the largest class or the cache limit go straight back to the
+//system. Safe to use from several threads.
+class BufferPool
+{
+public:
+    struct Stats
+    {
+        uint64_t allocations; //requests served
+        uint64_t reused; //of which came from a free list
+        size_t liveBytes; //handed out and not yet released
+        size_t peakBytes; //highest liveBytes so far
+        size_t cachedBytes; //held in the free lists
+    };
+
+    /* constructors and destructors */
+    BufferPool();
+    ~BufferPool();
+
+    //The pool shared by everything in the process
+    static BufferPool &get();
+
+    //Returns at least size bytes; capacity receives the real size, which has
+    //to be passed back to release(). Throws std::bad_alloc.
+    uint8_t *acquire(size_t size, bool zero, size_t &capacity);
+    void release(uint8_t *buffer, size_t capacity);
+
+    Stats getStats() const;
+    //Frees every cached buffer
+    void trim();
+
+private:
+    BufferPool(const BufferPool &);
+    BufferPool &operator=(const BufferPool &);
+
+    static uint8_t *allocate(size_t size);
+    static void free(uint8_t *buffer);
+
+    mutable std::mutex mutex;
+    std::vector<uint8_t*> freeLists[BUFFERPOOL_CLASSES];
+    Stats stats;
+};
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,65 @@
+#include "casefoldeddir.h"
+
+#include <memory>
+#include <mutex>
+
+/* constructors and destructors */
+CaseFoldedDir::CaseFoldedDir(const std::string &path) :
+    path(path),
+    entries(Util::listEntries(path))
+{
+    folded.reserve(entries.size());
+    index.reserve(entries.size());
+    for (unsigned int i = 0; i < entries.size(); ++i) {
+        folded.push_back(fold(entries[i].name));
+        index.insert(std::make_pair(folded.back(), i));
+    }
+}
+
+const CaseFoldedDir &CaseFoldedDir::get(const std::string &path)
+{
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<CaseFoldedDir> > cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<CaseFoldedDir> &dir = cache[path];
+    if (!dir) {
+        try {
+            dir.reset(new CaseFoldedDir(path));
+        } catch (...) {
+            cache.erase(path);
+            throw;
+        }
+    }
+    return *dir;
+}
+
+std::string CaseFoldedDir::fold(const std::string &name)
+{
+    //Nearly all names are plain ASCII, which needs no conversion
+    std::string result(name);
+    for (unsigned int i = 0; i < result.size(); ++i) {
+        unsigned char c = result[i];
+        if (c >= 0x80)
+            return Util::toLower(name);
+        if (c >= 'A' && c <= 'Z')
+            result[i] = c + ('a' - 'A');
+    }
+    return result;
+}
+
+const Util::DirEntry *CaseFoldedDir::find(const std::string &name) const
+{
+    std::unordered_map<std::string, unsigned int>::const_iterator found = index.find(fold(name));
+    if (found == index.end())
+        return NULL;
+    return &entries[found->second];
+}
+
+const Util::DirEntry *CaseFoldedDir::find(const std::string &name, Util::DirEntry::Type type) const
+{
+    const Util::DirEntry *entry = find(name);
+    if (entry == NULL || entry->type != type)
+        return NULL;
+    return entry;
+}
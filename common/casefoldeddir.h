@@ -0,0 +1,42 @@
+#ifndef CASEFOLDEDDIR_H
+#define CASEFOLDEDDIR_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "util.h"
+
+//Case-insensitive index of one directory's entries. The directory is listed
+//once and every name is folded up front, so lookups are a hash probe.
+class CaseFoldedDir
+{
+public:
+    /* constructors and destructors */
+    explicit CaseFoldedDir(const std::string &path);
+
+    //Shared index for path (ending with a separator), built on first use and
+    //kept for the rest of the run
+    static const CaseFoldedDir &get(const std::string &path);
+
+    //Fold a name the same way the index does
+    static std::string fold(const std::string &name);
+
+    //Accessors
+    const std::string &getPath() const { return path; }
+    const std::vector<Util::DirEntry> &getEntries() const { return entries; }
+    const std::string &getFoldedName(unsigned int index) const { return folded[index]; }
+
+    //Entry whose name matches case-insensitively, or NULL. If several do, the
+    //first one listed wins.
+    const Util::DirEntry *find(const std::string &name) const;
+    const Util::DirEntry *find(const std::string &name, Util::DirEntry::Type type) const;
+
+private:
+    std::string path;
+    std::vector<Util::DirEntry> entries;
+    std::vector<std::string> folded;
+    std::unordered_map<std::string, unsigned int> index;
+};
+
+#endif // CASEFOLDEDDIR_H
@@ -0,0 +1,156 @@
+#include "contenthash.h"
+
+#include <stdexcept>
+
+#include <cstring>
+
+#include "bitmap.h"
+#include "fileview.h"
+#include "threadpool.h"
+
+static const uint64_t prime1 = UINT64_C(0x9E3779B185EBCA87);
+static const uint64_t prime2 = UINT64_C(0xC2B2AE3D27D4EB4F);
+static const uint64_t prime3 = UINT64_C(0x165667B19E3779F9);
+static const uint64_t prime4 = UINT64_C(0x85EBCA77C2B2AE63);
+static const uint64_t prime5 = UINT64_C(0x27D4EB2F165667C5);
+
+static inline uint64_t rotl(uint64_t x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+//Little-endian loads, whatever the machine
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint64_t round(uint64_t lane, uint64_t input)
+{
+    return rotl(lane + input * prime2, 31) * prime1;
+}
+
+static inline uint64_t mergeRound(uint64_t hash, uint64_t lane)
+{
+    return (hash ^ round(0, lane)) * prime1 + prime4;
+}
+
+/* constructors and destructors */
+ContentHash::ContentHash(uint64_t seed) :
+    seed(seed),
+    buffered(0),
+    total(0)
+{
+    lanes[0] = seed + prime1 + prime2;
+    lanes[1] = seed + prime2;
+    lanes[2] = seed;
+    lanes[3] = seed - prime1;
+}
+
+void ContentHash::consume(const uint8_t *block)
+{
+    for (unsigned int i = 0; i < 4; ++i)
+        lanes[i] = round(lanes[i], read64(block + i * 8));
+}
+
+void ContentHash::update(const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    total += size;
+
+    if (buffered > 0) {
+        size_t chunk = std::min(size, sizeof(buffer) - buffered);
+        memcpy(buffer + buffered, p, chunk);
+        buffered += chunk;
+        p += chunk;
+        size -= chunk;
+        if (buffered < sizeof(buffer))
+            return;
+        consume(buffer);
+        buffered = 0;
+    }
+    for (; size >= 32; p += 32, size -= 32)
+        consume(p);
+    memcpy(buffer, p, size);
+    buffered = size;
+}
+
+uint64_t ContentHash::digest() const
+{
+    uint64_t hash;
+    if (total >= 32) {
+        hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (unsigned int i = 0; i < 4; ++i)
+            hash = mergeRound(hash, lanes[i]);
+    } else {
+        hash = seed + prime5;
+    }
+    hash += total;
+
+    //The tail
+    const uint8_t *p = buffer;
+    size_t size = buffered;
+    for (; size >= 8; p += 8, size -= 8)
+        hash = rotl(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+    if (size >= 4) {
+        hash = rotl(hash ^ (read32(p) * prime1), 23) * prime2 + prime3;
+        p += 4;
+        size -= 4;
+    }
+    for (; size > 0; ++p, --size)
+        hash = rotl(hash ^ (*p * prime5), 11) * prime1;
+
+    //Avalanche
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+std::string ContentHash::toString(uint64_t hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string result(16, '0');
+    for (int i = 15; i >= 0; --i, hash >>= 4)
+        result[i] = digits[hash & 0xF];
+    return result;
+}
+
+uint64_t hashFile(const std::string &filename)
+{
+    FileView file(filename);
+    ContentHash hash;
+    hash.update(file.data(), file.size());
+    return hash.digest();
+}
+
+void hashImageFiles(const std::vector<std::string> &filenames, std::vector<std::string> &hashes,
+                    std::vector<std::string> &errors, unsigned int threads)
+{
+    hashes.assign(filenames.size(), std::string());
+    errors.assign(filenames.size(), std::string());
+
+    //Each task writes only its own slots
+    ThreadPool pool(threads);
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        pool.run([&, i]() {
+            try {
+                Bitmap image(filenames[i]);
+                hashes[i] = ContentHash::toString(image.contentHash());
+            } catch (std::runtime_error &e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+    pool.wait();
+}
@@ -0,0 +1,44 @@
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+#include <stdint.h>
+
+#include <cstddef>
+
+#include <string>
+#include <vector>
+
+//Streaming 64-bit hash (XXH64): fast, not cryptographic. Input can be fed in
+//pieces of any size; the result only depends on the concatenation.
+class ContentHash
+{
+public:
+    /* constructors and destructors */
+    explicit ContentHash(uint64_t seed = 0);
+
+    void update(const void *data, size_t size);
+    uint64_t digest() const;
+
+    //16 lowercase hex digits
+    static std::string toString(uint64_t hash);
+
+private:
+    void consume(const uint8_t *block);
+
+    uint64_t seed;
+    uint64_t lanes[4];
+    uint8_t buffer[32];
+    size_t buffered;
+    uint64_t total;
+};
+
+//ContentHash of a whole file, as stored
+uint64_t hashFile(const std::string &filename);
+
+//Content hashes (BitmapView::contentHash) of many image files, decoded in
+//parallel. hashes[i] is empty for a file that could not be hashed, and
+//errors[i] says why.
+void hashImageFiles(const std::vector<std::string> &filenames, std::vector<std::string> &hashes,
+                    std::vector<std::string> &errors, unsigned int threads = 0);
+
+#endif // CONTENTHASH_H
@@ -0,0 +1,195 @@
+#include "deflater.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+#include <cstring>
+
+#include "threadpool.h"
+
+//Shared by every Deflater; idle unless a large image is being written
+static ThreadPool &deflatePool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/* constructors and destructors */
+Deflater::Deflater(const Sink &sink, int level, unsigned int threads) :
+    sink(sink),
+    level(level),
+    maxBlocks(2 * (threads == 0 ? ThreadPool::defaultThreads() : threads)),
+    serial(false),
+    parallel(false),
+    current(new std::vector<uint8_t>),
+    adler(adler32(0, NULL, 0))
+{
+    std::memset(&stream, 0, sizeof(stream));
+    if (threads == 1) {
+        if (deflateInit(&stream, level) != Z_OK)
+            throw std::runtime_error("zlib error");
+        serial = true;
+        buffer.resize(DEFLATE_OUTPUT_SIZE);
+    } else {
+        current->reserve(DEFLATE_BLOCK_SIZE);
+    }
+}
+
+Deflater::~Deflater()
+{
+    //Blocks still in flight own their data and finish on their own
+    if (serial)
+        deflateEnd(&stream);
+}
+
+void Deflater::write(const uint8_t *src, size_t size)
+{
+    if (serial) {
+        deflateSerial(src, size, Z_NO_FLUSH);
+        return;
+    }
+
+    while (size > 0) {
+        size_t chunk = std::min(size, DEFLATE_BLOCK_SIZE - current->size());
+        current->insert(current->end(), src, src + chunk);
+        src += chunk;
+        size -= chunk;
+        if (current->size() == DEFLATE_BLOCK_SIZE)
+            dispatch(false);
+    }
+}
+
+void Deflater::finish()
+{
+    if (!serial && !parallel) {
+        //Everything fit in one block; plain zlib does it best
+        if (deflateInit(&stream, level) != Z_OK)
+            throw std::runtime_error("zlib error");
+        serial = true;
+        buffer.resize(DEFLATE_OUTPUT_SIZE);
+        deflateSerial(current->data(), current->size(), Z_FINISH);
+        current.reset();
+        return;
+    }
+    if (serial) {
+        deflateSerial(NULL, 0, Z_FINISH);
+        return;
+    }
+
+    dispatch(true);
+    while (!blocks.empty())
+        emitOldest();
+
+    //Trailer: big-endian Adler-32 of all input
+    uint8_t trailer[4] = {
+        static_cast<uint8_t>(adler >> 24), static_cast<uint8_t>(adler >> 16),
+        static_cast<uint8_t>(adler >> 8), static_cast<uint8_t>(adler)
+    };
+    sink(trailer, sizeof(trailer));
+}
+
+void Deflater::deflateSerial(const uint8_t *src, size_t size, int flush)
+{
+    stream.next_in = const_cast<Bytef*>(src);
+    stream.avail_in = static_cast<uInt>(size);
+    int result;
+    do {
+        stream.next_out = buffer.data();
+        stream.avail_out = buffer.size();
+        result = deflate(&stream, flush);
+        if (result == Z_STREAM_ERROR)
+            throw std::runtime_error("zlib error");
+        size_t produced = buffer.size() - stream.avail_out;
+        if (produced > 0)
+            sink(buffer.data(), produced);
+    } while (stream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+}
+
+void Deflater::dispatch(bool last)
+{
+    if (!parallel) {
+        //zlib header, with the level hint zlib itself would put there
+        int effective = level == Z_DEFAULT_COMPRESSION ? 6 : level;
+        unsigned int hint = effective < 2 ? 0 : effective < 6 ? 1 : effective == 6 ? 2 : 3;
+        unsigned int header = (0x78 << 8) | (hint << 6);
+        header += 31 - header % 31;
+        uint8_t bytes[2] = {static_cast<uint8_t>(header >> 8), static_cast<uint8_t>(header)};
+        sink(bytes, sizeof(bytes));
+        parallel = true;
+    }
+
+    //Keep the number of blocks (and so memory) bounded
+    while (blocks.size() >= maxBlocks)
+        emitOldest();
+
+    std::shared_ptr<Block> block(new Block);
+    block->input = current;
+    block->previous = previous;
+    block->last = last;
+    block->level = level;
+    std::shared_ptr<std::packaged_task<void()> > task(
+        new std::packaged_task<void()>(std::bind(&Block::compress, block)));
+    block->done = task->get_future();
+    blocks.push_back(block);
+    deflatePool().run([task]() { (*task)(); });
+
+    previous = current;
+    current.reset(new std::vector<uint8_t>);
+    if (!last)
+        current->reserve(DEFLATE_BLOCK_SIZE);
+}
+
+void Deflater::emitOldest()
+{
+    std::shared_ptr<Block> block = blocks.front();
+    blocks.pop_front();
+    block->done.get();
+    if (!block->output.empty())
+        sink(block->output.data(), block->output.size());
+    adler = adler32_combine(adler, block->adler, block->input->size());
+}
+
+//Raw deflate of one block, primed with the tail of the block before it
+void Deflater::Block::compress()
+{
+    adler = adler32(adler32(0, NULL, 0), input->data(), input->size());
+
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("zlib error");
+
+    bool failed = false;
+    if (previous) {
+        size_t size = std::min<size_t>(previous->size(), DEFLATE_WINDOW_SIZE);
+        failed = deflateSetDictionary(&stream, previous->data() + previous->size() - size, size) != Z_OK;
+    }
+
+    //Room for the worst case plus the sync flush marker
+    output.resize(deflateBound(&stream, input->size()) + 16);
+    stream.next_in = input->data();
+    stream.avail_in = input->size();
+    stream.next_out = output.data();
+    stream.avail_out = output.size();
+    int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    while (!failed) {
+        int result = deflate(&stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            failed = true;
+        } else if (last ? result == Z_STREAM_END : stream.avail_out != 0) {
+            break;
+        } else if (stream.avail_out == 0) {
+            size_t used = output.size();
+            output.resize(used * 2);
+            stream.next_out = output.data() + used;
+            stream.avail_out = output.size() - used;
+        }
+    }
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (failed)
+        throw std::runtime_error("zlib error");
+
+    //Done with the dictionary
+    previous.reset();
+}
@@ -0,0 +1,77 @@
+#ifndef DEFLATER_H
+#define DEFLATER_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <zlib.h>
+
+#define DEFLATE_BLOCK_SIZE (128 * 1024)
+#define DEFLATE_WINDOW_SIZE (32 * 1024)
+#define DEFLATE_OUTPUT_SIZE (64 * 1024)
+
+//Produces a zlib stream. Small inputs are compressed serially with plain
+//zlib; as soon as the input outgrows one block, blocks are compressed
+//concurrently the way pigz does it: each is primed with the 32K before it as
+//dictionary and ends on a sync flush, so the pieces concatenate into one
+//standard stream.
+class Deflater
+{
+public:
+    typedef std::function<void(const uint8_t *data, size_t size)> Sink;
+
+    /* constructors and destructors */
+    //Compressed data goes to sink, always in order and from the calling
+    //thread. threads caps the blocks in flight; 0 uses every core and 1
+    //never leaves the calling thread.
+    explicit Deflater(const Sink &sink, int level = Z_DEFAULT_COMPRESSION, unsigned int threads = 0);
+    ~Deflater();
+
+    void write(const uint8_t *src, size_t size);
+    //Ends the stream; nothing can be written afterwards
+    void finish();
+
+private:
+    Deflater(const Deflater &);
+    Deflater &operator=(const Deflater &);
+
+    struct Block
+    {
+        std::shared_ptr<std::vector<uint8_t> > input;
+        std::shared_ptr<std::vector<uint8_t> > previous; //dictionary source
+        bool last;
+        int level;
+        std::vector<uint8_t> output;
+        uLong adler;
+        std::future<void> done;
+
+        void compress();
+    };
+
+    void deflateSerial(const uint8_t *src, size_t size, int flush);
+    void dispatch(bool last);
+    void emitOldest();
+
+    Sink sink;
+    int level;
+    unsigned int maxBlocks;
+
+    //Serial mode
+    bool serial;
+    z_stream stream;
+    std::vector<uint8_t> buffer;
+
+    //Parallel mode
+    bool parallel;
+    std::shared_ptr<std::vector<uint8_t> > current;
+    std::shared_ptr<std::vector<uint8_t> > previous;
+    std::deque<std::shared_ptr<Block> > blocks;
+    uLong adler;
+};
+
+#endif // DEFLATER_H
@@ -0,0 +1,422 @@
+#include "file.h"
+
+#if defined OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#endif
+
+#include <stdexcept>
+#include <cstring>
+
+#include "util.h"
+
+//Alignment of buffers, offsets and sizes for direct I/O
+#define DIRECT_ALIGN 4096
+
+#define ERROR_EOF "unexpected end of file"
+#define ERROR_READ "read error"
+#define ERROR_WRITE "write error"
+
+/* constructors and destructors */
+File::File() :
+    mode(Read),
+#if defined OS_W32
+    handle(INVALID_HANDLE_VALUE),
+#else
+    fd(-1),
+#endif
+    direct(false),
+    buffer(NULL), bufferSize(0), bufferOffset(0), bufferPos(0), bufferEnd(0)
+{
+}
+
+File::File(const std::string &filename, Mode mode, size_t bufferSize, bool direct) :
+    mode(Read),
+#if defined OS_W32
+    handle(INVALID_HANDLE_VALUE),
+#else
+    fd(-1),
+#endif
+    direct(false),
+    buffer(NULL), bufferSize(0), bufferOffset(0), bufferPos(0), bufferEnd(0)
+{
+    open(filename, mode, bufferSize, direct);
+}
+
+File::~File()
+{
+    try {
+        close();
+    } catch (std::runtime_error &e) {
+        //Nowhere to report it; callers who care call close() themselves
+    }
+}
+
+void File::read(void *dst, size_t size)
+{
+    uint8_t *out = static_cast<uint8_t*>(dst);
+    while (size > 0) {
+        //Serve what we can from the buffer
+        if (bufferPos < bufferEnd) {
+            size_t n = bufferEnd - bufferPos < size ? bufferEnd - bufferPos : size;
+            std::memcpy(out, buffer + bufferPos, n);
+            bufferPos += n;
+            out += n;
+            size -= n;
+            continue;
+        }
+
+        uint64_t pos = tell();
+        if (!direct && size >= bufferSize) {
+            //Large reads go straight to the destination
+            size_t n = rawRead(out, size, pos);
+            bufferOffset = pos + n;
+            bufferPos = bufferEnd = 0;
+            if (n < size)
+                throw std::runtime_error(ERROR_EOF);
+            return;
+        }
+
+        //Refill the buffer; direct I/O needs an aligned offset
+        uint64_t offset = direct ? pos & ~static_cast<uint64_t>(DIRECT_ALIGN - 1) : pos;
+        bufferEnd = rawRead(buffer, bufferSize, offset);
+        bufferOffset = offset;
+        bufferPos = pos - offset;
+        if (bufferPos >= bufferEnd) {
+            bufferPos = bufferEnd;
+            throw std::runtime_error(ERROR_EOF);
+        }
+    }
+}
+
+void File::write(const void *src, size_t size)
+{
+    if (mode != Write)
+        throw std::runtime_error(ERROR_WRITE);
+
+    const uint8_t *in = static_cast<const uint8_t*>(src);
+    while (size > 0) {
+        if (bufferPos == 0 && size >= bufferSize && !direct) {
+            //Large writes go straight to the file
+            rawWrite(in, size, bufferOffset);
+            bufferOffset += size;
+            return;
+        }
+        size_t n = bufferSize - bufferPos < size ? bufferSize - bufferPos : size;
+        std::memcpy(buffer + bufferPos, in, n);
+        bufferPos += n;
+        in += n;
+        size -= n;
+        if (bufferPos == bufferSize)
+            flush();
+    }
+}
+
+void File::seek(uint64_t pos)
+{
+    if (mode == Write) {
+        flush();
+        bufferOffset = pos;
+    } else if (pos >= bufferOffset && pos <= bufferOffset + bufferEnd) {
+        bufferPos = pos - bufferOffset;
+    } else {
+        bufferOffset = pos;
+        bufferPos = bufferEnd = 0;
+    }
+}
+
+void File::flush()
+{
+    if (mode != Write || bufferPos == 0)
+        return;
+    rawWrite(buffer, bufferPos, bufferOffset);
+    bufferOffset += bufferPos;
+    bufferPos = 0;
+}
+
+size_t File::pread(void *dst, size_t size, uint64_t offset)
+{
+    flush();
+    return rawRead(dst, size, offset);
+}
+
+void File::pwrite(const void *src, size_t size, uint64_t offset)
+{
+    if (mode != Write)
+        throw std::runtime_error(ERROR_WRITE);
+    flush();
+    rawWrite(src, size, offset);
+}
+
+#if defined OS_W32
+
+void File::open(const std::string &filename, Mode mode, size_t bufferSize, bool direct)
+{
+    UNUSED(direct);
+    close();
+
+    if (mode == Read) {
+        handle = CreateFileW(W32::toWide(filename).c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    } else {
+        handle = CreateFileW(W32::toWide(filename).c_str(), GENERIC_WRITE, 0,
+                             NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (handle == INVALID_HANDLE_VALUE)
+        throw std::runtime_error(filename + (mode == Read ? ": could not open file" : ": could not open file for writing"));
+
+    this->filename = filename;
+    this->mode = mode;
+    this->direct = false;
+    this->bufferSize = bufferSize > 0 ? bufferSize : 1;
+    buffer = new uint8_t[this->bufferSize];
+    bufferOffset = bufferPos = bufferEnd = 0;
+}
+
+void File::close()
+{
+    if (handle == INVALID_HANDLE_VALUE)
+        return;
+    bool failed = false;
+    try {
+        flush();
+    } catch (std::runtime_error &e) {
+        failed = true;
+    }
+    CloseHandle(handle);
+    handle = INVALID_HANDLE_VALUE;
+    delete[] buffer;
+    buffer = NULL;
+    if (failed)
+        throw std::runtime_error(ERROR_WRITE);
+}
+
+bool File::isOpen() const
+{
+    return handle != INVALID_HANDLE_VALUE;
+}
+
+uint64_t File::size() const
+{
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size))
+        throw std::runtime_error(ERROR_READ);
+    uint64_t result = size.QuadPart;
+    if (mode == Write && tell() > result)
+        result = tell();
+    return result;
+}
+
+size_t File::rawRead(void *dst, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        OVERLAPPED overlapped;
+        std::memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = static_cast<DWORD>(offset + done);
+        overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+        DWORD chunk = size - done > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size - done);
+        DWORD n = 0;
+        if (!ReadFile(handle, static_cast<uint8_t*>(dst) + done, chunk, &n, &overlapped)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            throw std::runtime_error(ERROR_READ);
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+void File::rawWrite(const void *src, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        OVERLAPPED overlapped;
+        std::memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = static_cast<DWORD>(offset + done);
+        overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+        DWORD chunk = size - done > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size - done);
+        DWORD n = 0;
+        if (!WriteFile(handle, static_cast<const uint8_t*>(src) + done, chunk, &n, &overlapped) || n == 0)
+            throw std::runtime_error(ERROR_WRITE);
+        done += n;
+    }
+}
+
+void File::dropDirect()
+{
+}
+
+void File::advise(Advice advice, uint64_t offset, uint64_t length)
+{
+    //Windows only takes access hints when the file is opened
+    UNUSED(advice);
+    UNUSED(offset);
+    UNUSED(length);
+}
+
+void File::preallocate(uint64_t size)
+{
+    UNUSED(size);
+}
+
+#elif defined OS_UNIX
+
+void File::open(const std::string &filename, Mode mode, size_t bufferSize, bool direct)
+{
+    close();
+
+    int flags = O_CLOEXEC | (mode == Read ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC);
+    fd = -1;
+#ifdef O_DIRECT
+    //Not every filesystem supports it (tmpfs, for one)
+    if (direct)
+        fd = ::open(filename.c_str(), flags | O_DIRECT, 0666);
+#endif
+    if (fd < 0) {
+        direct = false;
+        fd = ::open(filename.c_str(), flags, 0666);
+    }
+    if (fd < 0)
+        throw std::runtime_error(filename + (mode == Read ? ": could not open file" : ": could not open file for writing"));
+
+    //Direct I/O needs an aligned buffer of whole blocks
+    bufferSize = (bufferSize + DIRECT_ALIGN - 1) & ~static_cast<size_t>(DIRECT_ALIGN - 1);
+    if (bufferSize == 0)
+        bufferSize = DIRECT_ALIGN;
+    void *memory = NULL;
+    if (posix_memalign(&memory, DIRECT_ALIGN, bufferSize) != 0) {
+        ::close(fd);
+        fd = -1;
+        throw std::runtime_error(filename + ": out of memory");
+    }
+
+    this->filename = filename;
+    this->mode = mode;
+    this->direct = direct;
+    this->bufferSize = bufferSize;
+    buffer = static_cast<uint8_t*>(memory);
+    bufferOffset = bufferPos = bufferEnd = 0;
+
+    if (mode == Read)
+        advise(Sequential);
+}
+
+void File::close()
+{
+    if (fd < 0)
+        return;
+    bool failed = false;
+    try {
+        flush();
+    } catch (std::runtime_error &e) {
+        failed = true;
+    }
+    if (::close(fd) != 0 && mode == Write)
+        failed = true;
+    fd = -1;
+    free(buffer);
+    buffer = NULL;
+    if (failed)
+        throw std::runtime_error(ERROR_WRITE);
+}
+
+bool File::isOpen() const
+{
+    return fd >= 0;
+}
+
+uint64_t File::size() const
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error(ERROR_READ);
+    uint64_t result = st.st_size;
+    if (mode == Write && tell() > result)
+        result = tell();
+    return result;
+}
+
+size_t File::rawRead(void *dst, size_t size, uint64_t offset)
+{
+    if (direct && ((reinterpret_cast<uintptr_t>(dst) | size | offset) & (DIRECT_ALIGN - 1)))
+        dropDirect();
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, static_cast<uint8_t*>(dst) + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error(ERROR_READ);
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+void File::rawWrite(const void *src, size_t size, uint64_t offset)
+{
+    if (direct && ((reinterpret_cast<uintptr_t>(src) | size | offset) & (DIRECT_ALIGN - 1)))
+        dropDirect();
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pwrite(fd, static_cast<const uint8_t*>(src) + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error(ERROR_WRITE);
+        done += n;
+    }
+}
+
+void File::dropDirect()
+{
+    //Unaligned transfers (typically the tail of the file) go through the page cache
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+    direct = false;
+}
+
+void File::advise(Advice advice, uint64_t offset, uint64_t length)
+{
+#ifdef POSIX_FADV_NORMAL
+    static const int advices[] = {
+        POSIX_FADV_NORMAL,
+        POSIX_FADV_SEQUENTIAL,
+        POSIX_FADV_RANDOM,
+        POSIX_FADV_WILLNEED,
+        POSIX_FADV_DONTNEED,
+    };
+    posix_fadvise(fd, offset, length, advices[advice]);
+#else
+    UNUSED(advice);
+    UNUSED(offset);
+    UNUSED(length);
+#endif
+}
+
+void File::preallocate(uint64_t size)
+{
+#if defined OS_LINUX
+    //Reserve the blocks without changing the file size, so a short write
+    //leaves no garbage behind. Unsupported filesystems just don't benefit.
+    if (size > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#else
+    UNUSED(size);
+#endif
+}
+
+#endif
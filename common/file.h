@@ -0,0 +1,86 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "os.h"
+
+#define FILE_DEFAULT_BUFFER_SIZE (256 * 1024)
+
+//Buffered binary file with positional I/O. All errors are reported as
+//std::runtime_error.
+class File
+{
+public:
+    enum Mode {
+        Read,
+        Write, //create or truncate
+    };
+
+    enum Advice {
+        Normal,
+        Sequential,
+        Random,
+        WillNeed,
+        DontNeed,
+    };
+
+    /* constructors and destructors */
+    File();
+    //direct asks for unbuffered device I/O (O_DIRECT) where the system and
+    //filesystem support it; it is silently dropped otherwise
+    File(const std::string &filename, Mode mode, size_t bufferSize = FILE_DEFAULT_BUFFER_SIZE, bool direct = false);
+    ~File();
+
+    void open(const std::string &filename, Mode mode, size_t bufferSize = FILE_DEFAULT_BUFFER_SIZE, bool direct = false);
+    void close();
+
+    //Accessors
+    bool isOpen() const;
+    const std::string &getFilename() const { return filename; }
+    uint64_t size() const;
+
+    //Sequential I/O through the buffer. read throws at end of file.
+    void read(void *dst, size_t size);
+    void write(const void *src, size_t size);
+    void seek(uint64_t pos);
+    uint64_t tell() const { return bufferOffset + bufferPos; }
+    void flush();
+
+    //Positional I/O; neither uses the buffer nor moves the position. pread
+    //returns fewer bytes than asked for only at end of file.
+    size_t pread(void *dst, size_t size, uint64_t offset);
+    void pwrite(const void *src, size_t size, uint64_t offset);
+
+    //Hints
+    void advise(Advice advice, uint64_t offset = 0, uint64_t length = 0);
+    //Reserve space for a file about to be written up to size bytes
+    void preallocate(uint64_t size);
+
+private:
+    File(const File &);
+    File &operator=(const File &);
+
+    size_t rawRead(void *dst, size_t size, uint64_t offset);
+    void rawWrite(const void *src, size_t size, uint64_t offset);
+    void dropDirect();
+
+    std::string filename;
+    Mode mode;
+#if defined OS_W32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    bool direct;
+
+    uint8_t *buffer;
+    size_t bufferSize;
+    uint64_t bufferOffset; //file offset of buffer[0]
+    size_t bufferPos;      //current position within the buffer
+    size_t bufferEnd;      //valid bytes when reading, pending bytes when writing
+};
+
+#endif // FILE_H
@@ -0,0 +1,141 @@
+#include "fileview.h"
+
+#if defined OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include <stdexcept>
+
+//Files smaller than this are cheaper to read than to map
+#define MMAP_THRESHOLD (64 * 1024)
+#define READ_CHUNK_SIZE (64 * 1024)
+
+#if defined OS_W32
+
+FileView::FileView(const std::string &filename) :
+    bytes(NULL), length(0), mapped(false)
+{
+    HANDLE hFile = CreateFileW(W32::toWide(filename).c_str(), GENERIC_READ, FILE_SHARE_READ,
+                               NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        throw std::runtime_error(filename + ": could not open file");
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size)) {
+        CloseHandle(hFile);
+        throw std::runtime_error(filename + ": could not get file size");
+    }
+    length = static_cast<size_t>(size.QuadPart);
+
+    if (length >= MMAP_THRESHOLD) {
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping != NULL) {
+            bytes = static_cast<const uint8_t*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+            //The view keeps the mapping alive
+            CloseHandle(hMapping);
+            mapped = bytes != NULL;
+        }
+    }
+
+    if (!mapped) {
+        buffer.resize(length);
+        size_t done = 0;
+        while (done < length) {
+            DWORD chunk = length - done < READ_CHUNK_SIZE ? length - done : READ_CHUNK_SIZE;
+            DWORD bytesRead;
+            if (!ReadFile(hFile, buffer.data() + done, chunk, &bytesRead, NULL) || bytesRead == 0) {
+                CloseHandle(hFile);
+                throw std::runtime_error(filename + ": read error");
+            }
+            done += bytesRead;
+        }
+        bytes = buffer.data();
+    }
+    CloseHandle(hFile);
+}
+
+FileView::~FileView()
+{
+    if (mapped)
+        UnmapViewOfFile(bytes);
+}
+
+#elif defined OS_UNIX
+
+FileView::FileView(const std::string &filename) :
+    bytes(NULL), length(0), mapped(false)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(filename + ": could not open file");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error(filename + ": could not get file size");
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        length = st.st_size;
+        if (length >= MMAP_THRESHOLD) {
+            void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, length, MADV_SEQUENTIAL);
+                bytes = static_cast<const uint8_t*>(map);
+                mapped = true;
+            }
+        }
+
+        //Small file, or mmap refused; read it at known offsets
+        if (!mapped) {
+            buffer.resize(length);
+            size_t done = 0;
+            while (done < length) {
+                ssize_t bytesRead = pread(fd, buffer.data() + done, length - done, done);
+                if (bytesRead < 0 && errno == EINTR)
+                    continue;
+                if (bytesRead <= 0) {
+                    close(fd);
+                    throw std::runtime_error(filename + ": read error");
+                }
+                done += bytesRead;
+            }
+        }
+    } else {
+        //Pipe or device; size unknown, read till EOF
+        for (;;) {
+            size_t done = buffer.size();
+            buffer.resize(done + READ_CHUNK_SIZE);
+            ssize_t bytesRead = read(fd, buffer.data() + done, READ_CHUNK_SIZE);
+            if (bytesRead < 0 && errno == EINTR) {
+                buffer.resize(done);
+                continue;
+            }
+            if (bytesRead < 0) {
+                close(fd);
+                throw std::runtime_error(filename + ": read error");
+            }
+            buffer.resize(done + bytesRead);
+            if (bytesRead == 0)
+                break;
+        }
+        length = buffer.size();
+    }
+    close(fd);
+
+    if (!mapped)
+        bytes = buffer.data();
+}
+
+FileView::~FileView()
+{
+    if (mapped)
+        munmap(const_cast<uint8_t*>(bytes), length);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef FILEVIEW_H
+#define FILEVIEW_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "os.h"
+
+//Read-only view of a whole file. Large regular files are memory-mapped;
+//small files, pipes and the like are read into an owned buffer instead.
+class FileView
+{
+public:
+    explicit FileView(const std::string &filename);
+    ~FileView();
+
+    //Accessors
+    const uint8_t *data() const { return bytes; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const uint8_t *begin() const { return bytes; }
+    const uint8_t *end() const { return bytes + length; }
+
+private:
+    FileView(const FileView &);
+    FileView &operator=(const FileView &);
+
+    const uint8_t *bytes;
+    size_t length;
+    bool mapped;
+    std::vector<uint8_t> buffer;
+};
+
+#endif // FILEVIEW_H
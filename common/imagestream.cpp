@@ -0,0 +1,609 @@
+#include "imagestream.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "fileview.h"
+
+#define ERROR_GENERIC "unknown read error"
+#define ERROR_WRITE "could not write file"
+
+static const char xyzMagicNumber[] = {'X', 'Y', 'Z', '1'};
+static const char bmpMagicNumber[] = {'B', 'M'};
+static const uint8_t pngMagicNumber[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+/* constructors and destructors */
+PngReader::PngReader(const uint8_t *data, size_t size) :
+    png(NULL), info(NULL),
+    data(data), size(size), offset(8),
+    width(0), height(0),
+    indexed(false),
+    passes(1)
+{
+    //Check the header
+    if (size < 8)
+        throw std::runtime_error("could not validate as PNG");
+    if (png_sig_cmp(const_cast<png_bytep>(data), 0, 8) != 0)
+        throw std::runtime_error("not a valid PNG file");
+
+    //Create
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png == NULL)
+        throw std::runtime_error(ERROR_GENERIC);
+    info = png_create_info_struct(png);
+    if (info == NULL) {
+        destroy();
+        throw std::runtime_error(ERROR_GENERIC);
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        destroy();
+        throw std::runtime_error(ERROR_GENERIC);
+    }
+
+    png_set_read_fn(png, this, readData);
+    png_set_sig_bytes(png, 8);
+    png_read_info(png, info);
+
+    //Basic info
+    width = png_get_image_width(png, info);
+    height = png_get_image_height(png, info);
+    if (width == 0 || height == 0) {
+        destroy();
+        throw std::runtime_error("invalid image dimensions");
+    }
+    indexed = png_get_color_type(png, info) == PNG_COLOR_TYPE_PALETTE;
+    if (indexed) {
+        //Get palette
+        png_colorp pngPalette = NULL;
+        int nPalette = 0;
+        if (png_get_PLTE(png, info, &pngPalette, &nPalette) != 0 && nPalette > 0) {
+            const uint8_t *colors = reinterpret_cast<const uint8_t*>(pngPalette);
+            palette.assign(colors, colors + nPalette * 3);
+        }
+
+        //Always hand out one byte per pixel
+        png_set_packing(png);
+    } else {
+        //Anything else becomes 8-bit RGBA; a tRNS key color turns into alpha
+        png_set_expand(png);
+        png_set_strip_16(png);
+        png_set_gray_to_rgb(png);
+        png_set_add_alpha(png, 0xFF, PNG_FILLER_AFTER);
+    }
+    passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+}
+
+PngReader::~PngReader()
+{
+    destroy();
+}
+
+void PngReader::destroy()
+{
+    if (png != NULL || info != NULL) {
+        png_free_data(png, info, PNG_FREE_ALL, -1);
+        png_destroy_read_struct(&png, &info, NULL);
+    }
+    png = NULL;
+    info = NULL;
+}
+
+void PngReader::readData(png_structp png, png_bytep dst, png_size_t size)
+{
+    PngReader *reader = static_cast<PngReader*>(png_get_io_ptr(png));
+    if (reader->size - reader->offset < size)
+        png_error(png, "unexpected end of file");
+    std::memcpy(dst, reader->data + reader->offset, size);
+    reader->offset += size;
+}
+
+void PngReader::readRow(uint8_t *row)
+{
+    if (setjmp(png_jmpbuf(png)))
+        throw std::runtime_error(ERROR_GENERIC);
+    png_read_row(png, row, NULL);
+}
+
+void PngReader::readImage(uint8_t *pixels, size_t stride)
+{
+    if (setjmp(png_jmpbuf(png)))
+        throw std::runtime_error(ERROR_GENERIC);
+
+    //libpng writes every pass straight into our rows
+    for (int pass = 0; pass < passes; ++pass) {
+        for (unsigned int y = 0; y < height; ++y)
+            png_read_row(png, pixels + y * stride, NULL);
+    }
+}
+
+static inline void putBigEndian(uint8_t *dst, uint32_t value)
+{
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+//Filters row (with prev the row above) into dst[1..width] and stores the
+//filter type in dst[0]. width counts bytes, not pixels; bpp is the distance
+//in bytes to the pixel on the left: 1 for indexed rows of any bit depth, 4
+//for RGBA.
+static void filterRow(uint8_t *dst, const uint8_t *row, const uint8_t *prev, size_t width, unsigned int bpp, int type)
+{
+    dst[0] = type;
+    ++dst;
+    switch (type) {
+    case PngFilterNone:
+        std::memcpy(dst, row, width);
+        break;
+    case PngFilterSub:
+        std::memcpy(dst, row, std::min<size_t>(bpp, width));
+        for (size_t x = bpp; x < width; ++x)
+            dst[x] = row[x] - row[x - bpp];
+        break;
+    case PngFilterUp:
+        for (size_t x = 0; x < width; ++x)
+            dst[x] = row[x] - prev[x];
+        break;
+    case PngFilterAverage:
+        for (size_t x = 0; x < bpp && x < width; ++x)
+            dst[x] = row[x] - (prev[x] >> 1);
+        for (size_t x = bpp; x < width; ++x)
+            dst[x] = row[x] - ((row[x - bpp] + prev[x]) >> 1);
+        break;
+    case PngFilterPaeth:
+        for (size_t x = 0; x < bpp && x < width; ++x)
+            dst[x] = row[x] - prev[x];
+        for (size_t x = bpp; x < width; ++x)
+            dst[x] = row[x] - paeth(row[x - bpp], prev[x], prev[x - bpp]);
+        break;
+    }
+}
+
+//The usual heuristic: smallest sum of the bytes taken as signed
+static unsigned int filterCost(const std::vector<uint8_t> &filtered)
+{
+    unsigned int cost = 0;
+    for (unsigned int x = 1; x < filtered.size(); ++x)
+        cost += abs(static_cast<int8_t>(filtered[x]));
+    return cost;
+}
+
+/* constructors and destructors */
+PngWriter::PngWriter(FILE *file, unsigned int width, unsigned int height, const std::vector<uint8_t> &palette, bool transparent,
+                     unsigned int bitDepth, int level, PngFilter filter, unsigned int threads) :
+    file(file),
+    width(width),
+    bitDepth(bitDepth),
+    bytesPerPixel(1),
+    rowBytes((static_cast<size_t>(width) * bitDepth + 7) / 8),
+    filter(filter),
+    deflater([this](const uint8_t *data, size_t size) { writeData(data, size); }, level, threads)
+{
+    if (bitDepth != 1 && bitDepth != 2 && bitDepth != 4 && bitDepth != 8)
+        throw std::runtime_error("invalid bit depth");
+    size_t nPalette = std::min<size_t>(palette.size() / 3, 1 << bitDepth);
+    if (nPalette == 0)
+        throw std::runtime_error("invalid palette");
+
+    writeHeader(height, PNG_COLOR_TYPE_PALETTE);
+    writeChunk("PLTE", palette.data(), nPalette * 3);
+    if (transparent) {
+        //Transparent color index
+        uint8_t trans = 0;
+        writeChunk("tRNS", &trans, 1);
+    }
+}
+
+PngWriter::PngWriter(FILE *file, unsigned int width, unsigned int height, int level, PngFilter filter, unsigned int threads) :
+    file(file),
+    width(width),
+    bitDepth(8),
+    bytesPerPixel(4),
+    rowBytes(static_cast<size_t>(width) * 4),
+    filter(filter),
+    deflater([this](const uint8_t *data, size_t size) { writeData(data, size); }, level, threads)
+{
+    writeHeader(height, PNG_COLOR_TYPE_RGB_ALPHA);
+}
+
+//Writes the signature and IHDR (not interlaced) and sets up the row buffers
+void PngWriter::writeHeader(unsigned int height, uint8_t colorType)
+{
+    if (width == 0 || height == 0 || width > 0x7FFFFFFF || height > 0x7FFFFFFF)
+        throw std::runtime_error("invalid image dimensions");
+
+    if (fwrite(pngMagicNumber, 1, sizeof(pngMagicNumber), file) != sizeof(pngMagicNumber))
+        throw std::runtime_error(ERROR_WRITE);
+
+    uint8_t header[13] = {0};
+    putBigEndian(header, width);
+    putBigEndian(header + 4, height);
+    header[8] = bitDepth;
+    header[9] = colorType;
+    writeChunk("IHDR", header, sizeof(header));
+
+    previous.resize(rowBytes);
+    if (bitDepth < 8)
+        packed.resize(rowBytes);
+    for (int type = PngFilterNone; type <= PngFilterPaeth; ++type) {
+        if (filter == PngFilterAdaptive || filter == type)
+            filtered[type].resize(rowBytes + 1);
+    }
+}
+
+void PngWriter::writeRow(const uint8_t *row)
+{
+    if (bitDepth < 8) {
+        //Several pixels per byte, leftmost in the high bits
+        unsigned int perByte = 8 / bitDepth;
+        for (size_t i = 0; i < rowBytes; ++i) {
+            unsigned int x = i * perByte;
+            unsigned int end = std::min(x + perByte, width);
+            uint8_t byte = 0;
+            for (unsigned int shift = 8 - bitDepth; x < end; ++x, shift -= bitDepth)
+                byte |= row[x] << shift;
+            packed[i] = byte;
+        }
+        row = packed.data();
+    }
+
+    const std::vector<uint8_t> *best;
+    if (filter == PngFilterAdaptive) {
+        unsigned int bestCost = 0;
+        best = NULL;
+        for (int type = PngFilterNone; type <= PngFilterPaeth; ++type) {
+            filterRow(filtered[type].data(), row, previous.data(), rowBytes, bytesPerPixel, type);
+            unsigned int cost = filterCost(filtered[type]);
+            if (best == NULL || cost < bestCost) {
+                best = &filtered[type];
+                bestCost = cost;
+            }
+        }
+    } else {
+        filterRow(filtered[filter].data(), row, previous.data(), rowBytes, bytesPerPixel, filter);
+        best = &filtered[filter];
+    }
+    deflater.write(best->data(), best->size());
+
+    if (filter != PngFilterNone && filter != PngFilterSub)
+        std::memcpy(previous.data(), row, rowBytes);
+}
+
+void PngWriter::finish()
+{
+    deflater.finish();
+    if (!idat.empty())
+        writeChunk("IDAT", idat.data(), idat.size());
+    writeChunk("IEND", NULL, 0);
+}
+
+void PngWriter::writeChunk(const char *type, const uint8_t *data, size_t size)
+{
+    uint8_t header[8];
+    putBigEndian(header, size);
+    std::memcpy(header + 4, type, 4);
+    uLong crc = crc32(0, header + 4, 4);
+    if (size > 0)
+        crc = crc32(crc, data, size);
+    uint8_t trailer[4];
+    putBigEndian(trailer, crc);
+
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)
+            || (size > 0 && fwrite(data, 1, size, file) != size)
+            || fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer))
+        throw std::runtime_error(ERROR_WRITE);
+}
+
+//Collects compressed data into IDAT chunks
+void PngWriter::writeData(const uint8_t *data, size_t size)
+{
+    idat.insert(idat.end(), data, data + size);
+    if (idat.size() >= PNG_IDAT_SIZE) {
+        writeChunk("IDAT", idat.data(), idat.size());
+        idat.clear();
+    }
+}
+
+/* constructors and destructors */
+XyzReader::XyzReader(const uint8_t *data, size_t size)
+{
+    if (size <= XYZ_HEADER_SIZE || std::memcmp(data, xyzMagicNumber, sizeof(xyzMagicNumber)))
+        throw std::runtime_error("not a valid XYZ file");
+
+    //Read the width and height
+    uint16_t dimensions[2];
+    std::memcpy(dimensions, data + 4, sizeof(dimensions));
+    width = dimensions[0];
+    height = dimensions[1];
+
+    //Inflate straight from the file
+    std::memset(&stream, 0, sizeof(stream));
+    stream.next_in = const_cast<Bytef*>(data + XYZ_HEADER_SIZE);
+    stream.avail_in = static_cast<uInt>(size - XYZ_HEADER_SIZE);
+    if (inflateInit(&stream) != Z_OK)
+        throw std::runtime_error("zlib error");
+
+    //The palette comes first
+    palette.resize(XYZ_PALETTE_SIZE);
+    try {
+        read(palette.data(), palette.size());
+    } catch (...) {
+        inflateEnd(&stream);
+        throw;
+    }
+}
+
+XyzReader::~XyzReader()
+{
+    inflateEnd(&stream);
+}
+
+void XyzReader::read(uint8_t *dst, size_t size)
+{
+    while (size > 0) {
+        uInt chunk = static_cast<uInt>(std::min<size_t>(size, XYZ_BUFFER_SIZE));
+        stream.next_out = dst;
+        stream.avail_out = chunk;
+        while (stream.avail_out > 0) {
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result == Z_STREAM_END && stream.avail_out > 0)
+                throw std::runtime_error("uncompressed image data too small");
+            if (result != Z_OK && result != Z_STREAM_END)
+                throw std::runtime_error("zlib error");
+        }
+        dst += chunk;
+        size -= chunk;
+    }
+}
+
+//Little-endian field of a BMP header
+static inline uint32_t bmpField(const uint8_t *data, size_t size, size_t offset, size_t length)
+{
+    if (offset + length > size)
+        throw std::runtime_error(ERROR_GENERIC);
+    uint32_t value = 0;
+    for (size_t i = 0; i < length; ++i)
+        value |= static_cast<uint32_t>(data[offset + i]) << (i * 8);
+    return value;
+}
+
+/* constructors and destructors */
+BmpReader::BmpReader(const uint8_t *data, size_t size) :
+    pixels(NULL),
+    y(0),
+    unsupported(NULL)
+{
+    //Read and verify magic number
+    if (size < sizeof(bmpMagicNumber) || std::memcmp(data, bmpMagicNumber, sizeof(bmpMagicNumber)))
+        throw std::runtime_error("not a valid BMP file");
+
+    //Read: pixel data offset, palette offset (just past the info header).
+    //Both are checked against the file before use, so neither can wrap.
+    uint32_t pixelOffset = bmpField(data, size, 10, 4);
+    uint32_t headerSize = bmpField(data, size, 14, 4);
+    if (pixelOffset > size || headerSize > size - 14)
+        throw std::runtime_error(ERROR_GENERIC);
+    uint32_t paletteOffset = headerSize + 14;
+
+    //Read: width, height, pixel order; basic sanity checking. INT32_MIN has
+    //no absolute value.
+    width = bmpField(data, size, 18, 4);
+    int32_t temp = static_cast<int32_t>(bmpField(data, size, 22, 4));
+    if (width == 0 || temp == 0 || temp == INT32_MIN)
+        throw std::runtime_error("invalid image dimensions");
+    topDown = temp < 0;
+    height = abs(temp);
+
+    //More sanity checking
+    if (bmpField(data, size, 26, 2) != 1)
+        unsupported = "number of BMP planes is not 1";
+    else if (bmpField(data, size, 28, 2) != 8)
+        unsupported = "BMP is not 8-bit";
+    else if (bmpField(data, size, 30, 4) != 0)
+        unsupported = "BMP is compressed";
+    if (unsupported != NULL)
+        return;
+
+    //Read palette info
+    uint32_t nPalette = bmpField(data, size, 14 + 32, 4);
+    if (nPalette > 256)
+        throw std::runtime_error("BMP header specifies more than 256 colors");
+    if (nPalette == 0)
+        nPalette = 256;
+
+    //Bounds-check palette and pixels, in 64 bits so the sums cannot wrap
+    if (static_cast<uint64_t>(paletteOffset) + nPalette * 4 > size
+            || pixelOffset > size || size - pixelOffset < static_cast<uint64_t>(width) * height)
+        throw std::runtime_error(ERROR_GENERIC);
+    pixels = data + pixelOffset;
+
+    //Populate palette
+    const uint8_t *bmpPalette = data + paletteOffset;
+    palette.resize(nPalette * 3);
+    for (unsigned int i = 0; i < nPalette; ++i) {
+        palette[i * 3 + 0] = bmpPalette[i * 4 + 2];
+        palette[i * 3 + 1] = bmpPalette[i * 4 + 1];
+        palette[i * 3 + 2] = bmpPalette[i * 4 + 0];
+    }
+}
+
+void BmpReader::readRow(uint8_t *row)
+{
+    if (unsupported != NULL)
+        throw std::runtime_error(unsupported);
+    if (y >= height)
+        throw std::runtime_error(ERROR_GENERIC);
+    size_t offset = static_cast<size_t>(topDown ? y : height - 1 - y) * width;
+    std::memcpy(row, pixels + offset, width);
+    ++y;
+}
+
+/* constructors and destructors */
+ImageReader::ImageReader(const std::string &filename) :
+    filename(filename),
+    format(Unknown),
+    width(0), height(0),
+    view(new FileView(filename)),
+    row(0)
+{
+    const uint8_t *data = view->data();
+    size_t size = view->size();
+    try {
+        if (size >= sizeof(xyzMagicNumber) && !std::memcmp(data, xyzMagicNumber, sizeof(xyzMagicNumber))) {
+            format = Xyz;
+            xyz.reset(new XyzReader(data, size));
+            width = xyz->getWidth();
+            height = xyz->getHeight();
+        } else if (size >= sizeof(pngMagicNumber) && !std::memcmp(data, pngMagicNumber, sizeof(pngMagicNumber))) {
+            format = Png;
+            png.reset(new PngReader(data, size));
+            width = png->getWidth();
+            height = png->getHeight();
+        } else if (size >= sizeof(bmpMagicNumber) && !std::memcmp(data, bmpMagicNumber, sizeof(bmpMagicNumber))) {
+            format = Bmp;
+            bmp.reset(new BmpReader(data, size));
+            width = bmp->getWidth();
+            height = bmp->getHeight();
+        }
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+}
+
+ImageReader::~ImageReader()
+{
+}
+
+bool ImageReader::isTruecolor() const
+{
+    return format == Png && !png->isIndexed();
+}
+
+bool ImageReader::isIndexed() const
+{
+    switch (format) {
+    case Xyz:
+        return true;
+    case Png:
+        return png->isIndexed();
+    case Bmp:
+        return bmp->isIndexed();
+    default:
+        return false;
+    }
+}
+
+const std::vector<uint8_t> &ImageReader::getPalette() const
+{
+    static const std::vector<uint8_t> none;
+    switch (format) {
+    case Xyz:
+        return xyz->getPalette();
+    case Png:
+        return png->getPalette();
+    case Bmp:
+        return bmp->getPalette();
+    default:
+        return none;
+    }
+}
+
+void ImageReader::readRow(uint8_t *dst)
+{
+    try {
+        switch (format) {
+        case Xyz:
+            xyz->read(dst, width);
+            break;
+        case Png:
+            if (png->isInterlaced()) {
+                //Every pass touches every row, so this needs the whole image
+                size_t rowBytes = static_cast<size_t>(width) * png->getBytesPerPixel();
+                if (whole.empty()) {
+                    whole.resize(rowBytes * height);
+                    png->readImage(whole.data(), rowBytes);
+                }
+                std::memcpy(dst, whole.data() + row * rowBytes, rowBytes);
+            } else {
+                png->readRow(dst);
+            }
+            break;
+        case Bmp:
+            bmp->readRow(dst);
+            break;
+        default:
+            throw std::runtime_error("unknown image format");
+        }
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    ++row;
+}
+
+void ImageReader::readImage(uint8_t *pixels, size_t stride)
+{
+    if (format == Png && row == 0) {
+        try {
+            png->readImage(pixels, stride);
+        } catch (std::runtime_error &e) {
+            throw std::runtime_error(filename + ": " + e.what());
+        }
+        row = height;
+        return;
+    }
+    for (unsigned int y = 0; y < height; ++y)
+        readRow(pixels + y * stride);
+}
+
+/* constructors and destructors */
+XyzWriter::XyzWriter(FILE *file, unsigned int width, unsigned int height, int level, unsigned int threads) :
+    file(file),
+    deflater([this](const uint8_t *data, size_t size) { writeData(data, size); }, level, threads)
+{
+    if (width > 0xFFFF || height > 0xFFFF)
+        throw std::runtime_error("invalid image dimensions");
+
+    //Write the magic number, width and height
+    uint16_t dimensions[2] = {static_cast<uint16_t>(width), static_cast<uint16_t>(height)};
+    if (fwrite(xyzMagicNumber, 1, 4, file) != 4
+            || fwrite(dimensions, 1, sizeof(dimensions), file) != sizeof(dimensions))
+        throw std::runtime_error(ERROR_WRITE);
+}
+
+void XyzWriter::writePalette(const std::vector<uint8_t> &palette)
+{
+    uint8_t padded[XYZ_PALETTE_SIZE] = {0};
+    std::memcpy(padded, palette.data(), std::min<size_t>(palette.size(), XYZ_PALETTE_SIZE));
+    write(padded, XYZ_PALETTE_SIZE);
+}
+
+void XyzWriter::write(const uint8_t *src, size_t size)
+{
+    deflater.write(src, size);
+}
+
+void XyzWriter::finish()
+{
+    deflater.finish();
+}
+
+void XyzWriter::writeData(const uint8_t *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size)
+        throw std::runtime_error(ERROR_WRITE);
+}
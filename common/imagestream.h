@@ -0,0 +1,244 @@
+#ifndef IMAGESTREAM_H
+#define IMAGESTREAM_H
+
+#include <stdint.h>
+
+#include <cstdio>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "deflater.h"
+
+class FileView;
+
+#define XYZ_HEADER_SIZE 8
+#define XYZ_PALETTE_SIZE (256 * 3)
+#define XYZ_BUFFER_SIZE (64 * 1024)
+#define PNG_IDAT_SIZE (64 * 1024)
+
+//Row-at-a-time readers and writers for the image formats. Only the current
+//row and the codec state are held in memory. All errors are reported as
+//std::runtime_error without a filename; callers add it (ImageReader does).
+
+//PNG decoder over an in-memory (usually mapped) file
+class PngReader
+{
+public:
+    /* constructors and destructors */
+    //Reads up to the first row
+    PngReader(const uint8_t *data, size_t size);
+    ~PngReader();
+
+    //Accessors
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    const std::vector<uint8_t> &getPalette() const { return palette; }
+    bool isIndexed() const { return indexed; }
+    //Indexed images are read as one byte per pixel, anything else as RGBA
+    unsigned int getBytesPerPixel() const { return indexed ? 1 : 4; }
+    //Interlaced images can only be read as a whole
+    bool isInterlaced() const { return passes > 1; }
+
+    //One row of width pixels; not for interlaced images
+    void readRow(uint8_t *row);
+    //Every pass, straight into rows stride bytes apart
+    void readImage(uint8_t *pixels, size_t stride);
+
+private:
+    PngReader(const PngReader &);
+    PngReader &operator=(const PngReader &);
+
+    static void readData(png_structp png, png_bytep dst, png_size_t size);
+    void destroy();
+
+    png_structp png;
+    png_infop info;
+    const uint8_t *data;
+    size_t size, offset;
+    unsigned int width, height;
+    bool indexed;
+    int passes;
+    std::vector<uint8_t> palette;
+};
+
+//How PNG rows are filtered before compression
+enum PngFilter {
+    PngFilterNone,
+    PngFilterSub,
+    PngFilterUp,
+    PngFilterAverage,
+    PngFilterPaeth,
+    PngFilterAdaptive, //per row, whichever filter looks smallest
+};
+
+//Indexed or RGBA PNG encoder. The chunks are written by hand so the image
+//data can go through a (parallel) Deflater; libpng is only used for reading.
+class PngWriter
+{
+public:
+    /* constructors and destructors */
+    //Writes the header of an indexed image; the file stays owned by the
+    //caller. bitDepth is 1, 2, 4 or 8, and palette must fit in it. threads is
+    //passed on to the Deflater.
+    PngWriter(FILE *file, unsigned int width, unsigned int height, const std::vector<uint8_t> &palette, bool transparent,
+              unsigned int bitDepth = 8, int level = Z_DEFAULT_COMPRESSION, PngFilter filter = PngFilterNone, unsigned int threads = 0);
+    //Same for an 8-bit RGBA image
+    PngWriter(FILE *file, unsigned int width, unsigned int height,
+              int level = Z_DEFAULT_COMPRESSION, PngFilter filter = PngFilterAdaptive, unsigned int threads = 0);
+
+    //Rows go top to bottom: width bytes each for indexed images (one per
+    //pixel at any bit depth), width * 4 for RGBA
+    void writeRow(const uint8_t *row);
+    void finish();
+
+private:
+    PngWriter(const PngWriter &);
+    PngWriter &operator=(const PngWriter &);
+
+    void writeHeader(unsigned int height, uint8_t colorType);
+    void writeChunk(const char *type, const uint8_t *data, size_t size);
+    void writeData(const uint8_t *data, size_t size);
+
+    FILE *file;
+    unsigned int width;
+    unsigned int bitDepth;
+    unsigned int bytesPerPixel; //rounded up, as the filters see it
+    size_t rowBytes;
+    PngFilter filter;
+    std::vector<uint8_t> packed; //below 8 bits only
+    std::vector<uint8_t> previous; //unfiltered, zero before the first row
+    std::vector<uint8_t> filtered[PngFilterPaeth + 1]; //filter type byte first
+    std::vector<uint8_t> idat;
+    Deflater deflater;
+};
+
+//XYZ decoder over an in-memory (usually mapped) file
+class XyzReader
+{
+public:
+    /* constructors and destructors */
+    //Reads up to the first row
+    XyzReader(const uint8_t *data, size_t size);
+    ~XyzReader();
+
+    //Accessors
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    const std::vector<uint8_t> &getPalette() const { return palette; }
+
+    //Inflates the next size bytes of pixels
+    void read(uint8_t *dst, size_t size);
+
+private:
+    XyzReader(const XyzReader &);
+    XyzReader &operator=(const XyzReader &);
+
+    z_stream stream;
+    unsigned int width, height;
+    std::vector<uint8_t> palette;
+};
+
+//BMP decoder over an in-memory (usually mapped) file
+class BmpReader
+{
+public:
+    /* constructors and destructors */
+    BmpReader(const uint8_t *data, size_t size);
+
+    //Accessors
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    const std::vector<uint8_t> &getPalette() const { return palette; }
+    //Only uncompressed 8-bit images can be read
+    bool isIndexed() const { return unsupported == NULL; }
+
+    //Rows top to bottom, whatever the order in the file
+    void readRow(uint8_t *row);
+
+private:
+    const uint8_t *pixels;
+    unsigned int width, height;
+    bool topDown;
+    unsigned int y;
+    const char *unsupported;
+    std::vector<uint8_t> palette;
+};
+
+//XYZ encoder
+class XyzWriter
+{
+public:
+    /* constructors and destructors */
+    //Writes the header; the file stays owned by the caller. threads is passed
+    //on to the Deflater.
+    XyzWriter(FILE *file, unsigned int width, unsigned int height, int level = Z_DEFAULT_COMPRESSION, unsigned int threads = 0);
+
+    //Takes the palette first (padded to 256 colors), then the rows
+    void writePalette(const std::vector<uint8_t> &palette);
+    void write(const uint8_t *src, size_t size);
+    void finish();
+
+private:
+    XyzWriter(const XyzWriter &);
+    XyzWriter &operator=(const XyzWriter &);
+
+    void writeData(const uint8_t *data, size_t size);
+
+    FILE *file;
+    Deflater deflater;
+};
+
+//Any supported image file, identified by its magic number rather than its
+//name. Opening parses just the header; the decoder then stays open, so
+//probing a file and decoding it cost a single open and parse.
+class ImageReader
+{
+public:
+    enum Format {
+        Unknown, //not an image; everything but the accessors throws
+        Xyz,
+        Png,
+        Bmp,
+    };
+
+    /* constructors and destructors */
+    //Throws only if the file cannot be read or a known format is malformed
+    explicit ImageReader(const std::string &filename);
+    ~ImageReader();
+
+    //Accessors
+    const std::string &getFilename() const { return filename; }
+    Format getFormat() const { return format; }
+    bool isIndexed() const;
+    //A truecolor PNG, read as RGBA
+    bool isTruecolor() const;
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    const std::vector<uint8_t> &getPalette() const;
+
+    //Rows top to bottom, width bytes each (width * 4 for truecolor images)
+    void readRow(uint8_t *row);
+    //The whole image into rows stride bytes apart; must come before any readRow
+    void readImage(uint8_t *pixels, size_t stride);
+
+private:
+    ImageReader(const ImageReader &);
+    ImageReader &operator=(const ImageReader &);
+
+    std::string filename;
+    Format format;
+    unsigned int width, height;
+    std::unique_ptr<FileView> view;
+    std::unique_ptr<XyzReader> xyz;
+    std::unique_ptr<PngReader> png;
+    std::unique_ptr<BmpReader> bmp;
+    std::vector<uint8_t> whole; //interlaced PNGs only
+    unsigned int row;
+};
+
+#endif // IMAGESTREAM_H
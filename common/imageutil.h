@@ -0,0 +1,76 @@
+#ifndef IMAGEUTIL_H
+#define IMAGEUTIL_H
+
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include <cstdio>
+
+#include "os.h"
+#include "util.h"
+
+//Internals shared by the Bitmap and RgbaBitmap implementations
+
+#define ERROR_WRITE "could not write file"
+
+//Clips a copy of the oW x oH rectangle at (oX, oY) in a srcWidth x srcHeight
+//source to (mX, mY) in a dstWidth x dstHeight destination, moving both
+//corners together. Returns whether anything is left to copy.
+static inline bool clipBlit(int &mX, int &mY, int &oX, int &oY, int &oW, int &oH,
+                            unsigned int srcWidth, unsigned int srcHeight, unsigned int dstWidth, unsigned int dstHeight)
+{
+    //Clip to the source...
+    if (oX < 0) {
+        mX -= oX;
+        oW += oX;
+        oX = 0;
+    }
+    if (oY < 0) {
+        mY -= oY;
+        oH += oY;
+        oY = 0;
+    }
+    oW = std::min(oW, static_cast<int>(srcWidth) - oX);
+    oH = std::min(oH, static_cast<int>(srcHeight) - oY);
+
+    //...and to the destination
+    if (mX < 0) {
+        oX -= mX;
+        oW += mX;
+        mX = 0;
+    }
+    if (mY < 0) {
+        oY -= mY;
+        oH += mY;
+        mY = 0;
+    }
+    oW = std::min(oW, static_cast<int>(dstWidth) - mX);
+    oH = std::min(oH, static_cast<int>(dstHeight) - mY);
+
+    return oW > 0 && oH > 0;
+}
+
+static inline FILE *openForWriting(const std::string &filename)
+{
+    FILE *file = Util::fopen(filename, U("wb"));
+    if (file == NULL)
+        throw std::runtime_error(filename + ": could not open file for writing");
+    return file;
+}
+
+//Runs write on a freshly opened file and closes it, naming the file in errors
+template <typename Write>
+static void writeAndClose(FILE *file, const std::string &filename, Write write)
+{
+    try {
+        write(file);
+    } catch (std::runtime_error &e) {
+        fclose(file);
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    if (fclose(file) != 0)
+        throw std::runtime_error(filename + ": " + ERROR_WRITE);
+}
+
+#endif // IMAGEUTIL_H
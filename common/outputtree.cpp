@@ -0,0 +1,164 @@
+#include "outputtree.h"
+
+#if defined OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include <stdexcept>
+#include <algorithm>
+
+#include "util.h"
+
+#if defined OS_W32
+#define SEPARATORS "\\/"
+#else
+#define SEPARATORS "/"
+#endif
+
+//dirname without empty or "." components, so that "A//./B/" and "A/B/" are
+//the same directory, and "" for the root itself. ".." is refused; it would
+//lead out of the tree.
+static std::string normalizeDir(const std::string &root, const std::string &dirname)
+{
+    std::string normalized;
+    for (size_t start = 0; start < dirname.size();) {
+        size_t end = std::min(dirname.find_first_of(SEPARATORS, start), dirname.size());
+        std::string name = dirname.substr(start, end - start);
+        if (name == "..")
+            throw std::runtime_error(root + dirname + ": invalid directory name");
+        if (!name.empty() && name != ".")
+            normalized += name + PATH_SEPARATOR;
+        start = end + 1;
+    }
+    return normalized;
+}
+
+#if defined OS_W32
+
+/* constructors and destructors */
+OutputTree::OutputTree(const std::string &root, unsigned int maxOpenDirs) :
+    root(root)
+{
+    UNUSED(maxOpenDirs);
+    Util::mkdirsForFile(root);
+    if (!Util::dirExists(root))
+        throw std::runtime_error(root + ": could not create directory");
+}
+
+OutputTree::~OutputTree()
+{
+}
+
+void OutputTree::mkdirs(const std::string &dirname)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string normalized = normalizeDir(root, dirname);
+    for (size_t pos = normalized.find(PATH_SEPARATOR); pos != std::string::npos;
+         pos = normalized.find(PATH_SEPARATOR, pos + 1)) {
+        std::string dir = normalized.substr(0, pos + 1);
+        if (created.insert(dir).second)
+            Util::mkdir(root + dir);
+    }
+}
+
+FILE *OutputTree::create(const std::string &filename)
+{
+    size_t pos = filename.find_last_of("\\/");
+    if (pos != std::string::npos)
+        mkdirs(filename.substr(0, pos + 1));
+
+    FILE *file = Util::fopen(root + filename, U("wb"));
+    if (file == NULL)
+        throw std::runtime_error(root + filename + ": could not open file for writing");
+    return file;
+}
+
+#elif defined OS_UNIX
+
+/* constructors and destructors */
+OutputTree::OutputTree(const std::string &root, unsigned int maxOpenDirs) :
+    root(root),
+    maxOpenDirs(maxOpenDirs ? maxOpenDirs : 1)
+{
+    Util::mkdirsForFile(root);
+    rootFd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0)
+        throw std::runtime_error(root + ": could not create directory");
+}
+
+OutputTree::~OutputTree()
+{
+    for (DirList::iterator it = openDirs.begin(); it != openDirs.end(); ++it)
+        close(it->second);
+    close(rootFd);
+}
+
+int OutputTree::openDir(const std::string &dirname)
+{
+    if (dirname.empty())
+        return rootFd;
+
+    //Already open?
+    std::unordered_map<std::string, DirList::iterator>::iterator found = openDirsIndex.find(dirname);
+    if (found != openDirsIndex.end()) {
+        openDirs.splice(openDirs.begin(), openDirs, found->second);
+        return found->second->second;
+    }
+
+    //Open relative to the parent, creating it the first time it is seen.
+    //dirname is normalized, so the parent is always shorter.
+    size_t pos = dirname.rfind('/', dirname.size() - 2);
+    std::string parentname = pos == std::string::npos ? std::string() : dirname.substr(0, pos + 1);
+    std::string name = dirname.substr(parentname.size(), dirname.size() - parentname.size() - 1);
+    if (parentname == dirname || name.empty())
+        throw std::runtime_error(root + dirname + ": invalid directory name");
+    int parent = openDir(parentname);
+    if (created.insert(dirname).second && mkdirat(parent, name.c_str(), 0777) != 0 && errno != EEXIST) {
+        created.erase(dirname);
+        throw std::runtime_error(root + dirname + ": could not create directory");
+    }
+    int fd = openat(parent, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(root + dirname + ": could not open directory");
+
+    //Evict the least recently used directory
+    if (openDirs.size() >= maxOpenDirs) {
+        close(openDirs.back().second);
+        openDirsIndex.erase(openDirs.back().first);
+        openDirs.pop_back();
+    }
+    openDirs.push_front(std::make_pair(dirname, fd));
+    openDirsIndex[dirname] = openDirs.begin();
+    return fd;
+}
+
+void OutputTree::mkdirs(const std::string &dirname)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    openDir(normalizeDir(root, dirname));
+}
+
+FILE *OutputTree::create(const std::string &filename)
+{
+    //Held until the file is open, so its directory cannot be evicted first
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t pos = filename.rfind('/');
+    int dir = pos == std::string::npos ? rootFd : openDir(normalizeDir(root, filename.substr(0, pos + 1)));
+    const char *name = filename.c_str() + (pos == std::string::npos ? 0 : pos + 1);
+
+    int fd = openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        throw std::runtime_error(root + filename + ": could not open file for writing");
+    FILE *file = fdopen(fd, "wb");
+    if (file == NULL) {
+        close(fd);
+        throw std::runtime_error(root + filename + ": could not open file for writing");
+    }
+    return file;
+}
+
+#endif
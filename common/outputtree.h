@@ -0,0 +1,58 @@
+#ifndef OUTPUTTREE_H
+#define OUTPUTTREE_H
+
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "os.h"
+
+#define OUTPUT_TREE_MAX_DIRS 64
+
+//Creates files below a root directory. Every directory is created at most
+//once, and on Unix the most recently used directories are kept open so
+//files can be created relative to their parent without resolving the whole
+//path again. It may be used from several threads at once.
+class OutputTree
+{
+public:
+    /* constructors and destructors */
+    explicit OutputTree(const std::string &root, unsigned int maxOpenDirs = OUTPUT_TREE_MAX_DIRS);
+    ~OutputTree();
+
+    //Accessors
+    const std::string &getRoot() const { return root; }
+
+    //Create a directory (ending with a separator) and any missing parents
+    void mkdirs(const std::string &dirname);
+
+    //Create or truncate a file for binary writing, making any missing parent
+    //directories. The caller must fclose the result.
+    FILE *create(const std::string &filename);
+
+private:
+    OutputTree(const OutputTree &);
+    OutputTree &operator=(const OutputTree &);
+
+#if defined OS_UNIX
+    int openDir(const std::string &dirname);
+#endif
+
+    std::string root;
+    std::mutex mutex;
+    std::unordered_set<std::string> created;
+#if defined OS_UNIX
+    typedef std::list<std::pair<std::string, int> > DirList;
+
+    int rootFd;
+    unsigned int maxOpenDirs;
+    DirList openDirs;
+    std::unordered_map<std::string, DirList::iterator> openDirsIndex;
+#endif
+};
+
+#endif // OUTPUTTREE_H
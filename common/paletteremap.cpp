@@ -0,0 +1,160 @@
+#include "paletteremap.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+#if defined __SSE2__ && defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#include <immintrin.h>
+#define PALETTEREMAP_HAVE_AVX512
+#endif
+
+#include "bitmap.h"
+
+//Index lookup of a single row through a 256-entry table
+typedef void (*RemapRow)(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t *table);
+
+static void remapRowScalar(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t *table)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = table[src[i]];
+}
+
+#ifdef PALETTEREMAP_HAVE_AVX512
+//A two-register byte permute looks up 128 entries at once, so two of them
+//cover the table, and the top bit of each index picks between them. Byte
+//shuffles (16 entries each) need so many steps to cover 256 that they lose
+//to plain scalar lookups.
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void remapRowAvx512(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t *table)
+{
+    const __m512i table0 = _mm512_loadu_si512(table);
+    const __m512i table1 = _mm512_loadu_si512(table + 64);
+    const __m512i table2 = _mm512_loadu_si512(table + 128);
+    const __m512i table3 = _mm512_loadu_si512(table + 192);
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i indices = _mm512_loadu_si512(src + i);
+        __m512i low = _mm512_permutex2var_epi8(table0, indices, table1);
+        __m512i high = _mm512_permutex2var_epi8(table2, indices, table3);
+        __m512i result = _mm512_mask_blend_epi8(_mm512_movepi8_mask(indices), low, high);
+        _mm512_storeu_si512(dst + i, result);
+    }
+    remapRowScalar(dst + i, src + i, n - i, table);
+}
+#endif
+
+static RemapRow chooseRemapRow()
+{
+#ifdef PALETTEREMAP_HAVE_AVX512
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw"))
+        return remapRowAvx512;
+#endif
+    return remapRowScalar;
+}
+
+static inline unsigned int colorAt(const std::vector<uint8_t> &palette, unsigned int index, unsigned int channel)
+{
+    return index * 3 + channel < palette.size() ? palette[index * 3 + channel] : 0;
+}
+
+//Index of the color in to closest to color index of from, searching from
+//first on; the earliest wins ties, so an exact match is always found first
+static unsigned int closest(const std::vector<uint8_t> &from, unsigned int index, const std::vector<uint8_t> &to,
+                            unsigned int first, unsigned int count)
+{
+    unsigned int best = first;
+    unsigned int bestDistance = ~0u;
+    for (unsigned int i = first; i < count; ++i) {
+        unsigned int distance = 0;
+        for (unsigned int c = 0; c < 3; ++c) {
+            int d = static_cast<int>(colorAt(from, index, c)) - static_cast<int>(colorAt(to, i, c));
+            distance += d * d;
+        }
+        if (distance < bestDistance) {
+            best = i;
+            bestDistance = distance;
+            if (distance == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+/* constructors and destructors */
+PaletteRemap::PaletteRemap()
+{
+    setIdentity();
+}
+
+PaletteRemap::PaletteRemap(const std::vector<uint8_t> &from, const std::vector<uint8_t> &to, bool transparent) :
+    palette(to)
+{
+    unsigned int count = to.size() / 3;
+    unsigned int first = transparent ? 1 : 0;
+    identity = true;
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (i == 0 && transparent)
+            table[i] = 0;
+        else
+            table[i] = count > first ? closest(from, i, to, first, count) : 0;
+        identity = identity && table[i] == i;
+    }
+}
+
+PaletteRemap PaletteRemap::merge(std::vector<uint8_t> &shared, const std::vector<uint8_t> &palette, bool transparent,
+                                 const BitmapView *image)
+{
+    uint32_t counts[256];
+    if (image != NULL)
+        image->countIndices(counts);
+
+    //The transparent color keeps its slot
+    if (transparent && shared.empty())
+        shared.insert(shared.end(), palette.begin(), palette.begin() + std::min<size_t>(palette.size(), 3));
+    shared.resize(std::max<size_t>(shared.size(), transparent ? 3 : 0));
+
+    PaletteRemap remap;
+    unsigned int first = transparent ? 1 : 0;
+    for (unsigned int i = first; i < 256; ++i) {
+        if (image != NULL ? counts[i] == 0 : i * 3 >= palette.size())
+            continue;
+        unsigned int count = shared.size() / 3;
+        unsigned int match = closest(palette, i, shared, first, count);
+        bool exact = match < count;
+        for (unsigned int c = 0; exact && c < 3; ++c)
+            exact = colorAt(palette, i, c) == colorAt(shared, match, c);
+        if (!exact && count < 256) {
+            for (unsigned int c = 0; c < 3; ++c)
+                shared.push_back(colorAt(palette, i, c));
+            match = count;
+        }
+        remap.table[i] = match;
+    }
+
+    remap.identity = true;
+    for (unsigned int i = 0; i < 256; ++i)
+        remap.identity = remap.identity && remap.table[i] == i;
+    remap.palette = shared;
+    return remap;
+}
+
+void PaletteRemap::apply(uint8_t *dst, const uint8_t *src, size_t n) const
+{
+    if (identity) {
+        if (dst != src)
+            memmove(dst, src, n);
+        return;
+    }
+    static const RemapRow remapRow = chooseRemapRow();
+    remapRow(dst, src, n, table);
+}
+
+void PaletteRemap::setIdentity()
+{
+    for (unsigned int i = 0; i < 256; ++i)
+        table[i] = i;
+    identity = true;
+}
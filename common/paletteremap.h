@@ -0,0 +1,47 @@
+#ifndef PALETTEREMAP_H
+#define PALETTEREMAP_H
+
+#include <stdint.h>
+
+#include <cstddef>
+
+#include <vector>
+
+class BitmapView;
+
+//Translates the indices of images drawn with one palette into another: each
+//color goes to the same color in the target palette, or the closest one when
+//there is none. With transparent, index 0 maps to index 0 and nothing else
+//does.
+class PaletteRemap
+{
+public:
+    /* constructors and destructors */
+    //Leaves every index alone
+    PaletteRemap();
+    PaletteRemap(const std::vector<uint8_t> &from, const std::vector<uint8_t> &to, bool transparent);
+
+    //Adds the colors of palette that image actually uses (all of them without
+    //an image) to shared, and returns the mapping into it. Colors already in
+    //shared are reused; once it holds 256, the closest one is taken. shared
+    //only ever grows, so earlier mappings into it stay valid.
+    static PaletteRemap merge(std::vector<uint8_t> &shared, const std::vector<uint8_t> &palette, bool transparent,
+                              const BitmapView *image = NULL);
+
+    //Accessors
+    uint8_t operator[](uint8_t index) const { return table[index]; }
+    const std::vector<uint8_t> &getPalette() const { return palette; }
+    bool isIdentity() const { return identity; }
+
+    //Maps n indices from src to dst, which may be the same
+    void apply(uint8_t *dst, const uint8_t *src, size_t n) const;
+
+private:
+    void setIdentity();
+
+    uint8_t table[256];
+    bool identity;
+    std::vector<uint8_t> palette; //the target
+};
+
+#endif // PALETTEREMAP_H
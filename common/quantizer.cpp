@@ -0,0 +1,254 @@
+#include "quantizer.h"
+
+#include <algorithm>
+
+#include "rgbabitmap.h"
+
+#define EXACT_TABLE_BITS 10 //room for 255 colors at a quarter full
+
+struct Quantizer::Box
+{
+    unsigned int lo[3], hi[3]; //inclusive, in cells
+    uint64_t count;
+};
+
+static inline unsigned int cellOf(const uint8_t *pixel)
+{
+    static const unsigned int shift = 8 - QUANTIZER_BITS;
+    return ((pixel[0] >> shift) << (QUANTIZER_BITS * 2)) | ((pixel[1] >> shift) << QUANTIZER_BITS) | (pixel[2] >> shift);
+}
+
+static inline unsigned int cellCoordinate(unsigned int cell, unsigned int channel)
+{
+    return (cell >> ((2 - channel) * QUANTIZER_BITS)) & ((1 << QUANTIZER_BITS) - 1);
+}
+
+static inline unsigned int cellAt(const unsigned int coordinates[3])
+{
+    return (coordinates[0] << (QUANTIZER_BITS * 2)) | (coordinates[1] << QUANTIZER_BITS) | coordinates[2];
+}
+
+//Calls f for every cell inside box
+template <typename F>
+static void forEachCell(const unsigned int lo[3], const unsigned int hi[3], F f)
+{
+    unsigned int c[3];
+    for (c[0] = lo[0]; c[0] <= hi[0]; ++c[0])
+        for (c[1] = lo[1]; c[1] <= hi[1]; ++c[1])
+            for (c[2] = lo[2]; c[2] <= hi[2]; ++c[2])
+                f(cellAt(c), c);
+}
+
+//Tightens box around the cells in it that are actually used
+static void shrink(unsigned int lo[3], unsigned int hi[3], uint64_t &count, const std::vector<uint32_t> &counts)
+{
+    unsigned int newLo[3] = {~0u, ~0u, ~0u};
+    unsigned int newHi[3] = {0, 0, 0};
+    count = 0;
+    forEachCell(lo, hi, [&](unsigned int cell, const unsigned int *c) {
+        if (counts[cell] == 0)
+            return;
+        count += counts[cell];
+        for (unsigned int i = 0; i < 3; ++i) {
+            newLo[i] = std::min(newLo[i], c[i]);
+            newHi[i] = std::max(newHi[i], c[i]);
+        }
+    });
+    if (count == 0)
+        return;
+    std::copy(newLo, newLo + 3, lo);
+    std::copy(newHi, newHi + 3, hi);
+}
+
+/* constructors and destructors */
+Quantizer::Quantizer(const RgbaBitmap &image) :
+    exact(false),
+    palette(3, 0)
+{
+    exact = collectExact(image);
+    if (!exact)
+        medianCut(image);
+}
+
+int Quantizer::findExact(uint32_t color) const
+{
+    uint32_t key = color | 0x1000000;
+    unsigned int mask = (1 << EXACT_TABLE_BITS) - 1;
+    for (unsigned int slot = (key * 2654435761u) >> (32 - EXACT_TABLE_BITS); ; slot = (slot + 1) & mask) {
+        if (keys[slot] == key)
+            return values[slot];
+        if (keys[slot] == 0)
+            return -1 - static_cast<int>(slot);
+    }
+}
+
+//Takes every color as is, unless there are too many
+bool Quantizer::collectExact(const RgbaBitmap &image)
+{
+    keys.assign(1 << EXACT_TABLE_BITS, 0);
+    values.assign(1 << EXACT_TABLE_BITS, 0);
+    bool keyFound = false;
+    uint32_t last = ~0u;
+    for (unsigned int y = 0; y < image.getHeight(); ++y) {
+        const uint8_t *pixel = image.getRow(y);
+        for (unsigned int x = 0; x < image.getWidth(); ++x, pixel += 4) {
+            if (pixel[3] < 128) {
+                if (!keyFound) {
+                    std::copy(pixel, pixel + 3, palette.begin());
+                    keyFound = true;
+                }
+                continue;
+            }
+            uint32_t color = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            if (color == last)
+                continue;
+            last = color;
+            int found = findExact(color);
+            if (found >= 0)
+                continue;
+            if (palette.size() == 256 * 3) {
+                keys.clear();
+                values.clear();
+                return false;
+            }
+            keys[-1 - found] = color | 0x1000000;
+            values[-1 - found] = palette.size() / 3;
+            palette.insert(palette.end(), pixel, pixel + 3);
+        }
+    }
+    return true;
+}
+
+void Quantizer::medianCut(const RgbaBitmap &image)
+{
+    palette.assign(3, 0);
+
+    //Histogram of the opaque pixels, with color sums for the averages
+    std::vector<uint32_t> counts(QUANTIZER_CELLS);
+    std::vector<uint64_t> sums(QUANTIZER_CELLS * 3);
+    bool keyFound = false;
+    for (unsigned int y = 0; y < image.getHeight(); ++y) {
+        const uint8_t *pixel = image.getRow(y);
+        for (unsigned int x = 0; x < image.getWidth(); ++x, pixel += 4) {
+            if (pixel[3] < 128) {
+                if (!keyFound) {
+                    std::copy(pixel, pixel + 3, palette.begin());
+                    keyFound = true;
+                }
+                continue;
+            }
+            unsigned int cell = cellOf(pixel);
+            ++counts[cell];
+            for (unsigned int c = 0; c < 3; ++c)
+                sums[cell * 3 + c] += pixel[c];
+        }
+    }
+
+    //Keep splitting the box with the most pixels times extent at its median,
+    //across its longest side, until the palette is full
+    std::vector<Box> boxes(1);
+    Box &first = boxes[0];
+    for (unsigned int c = 0; c < 3; ++c) {
+        first.lo[c] = 0;
+        first.hi[c] = (1 << QUANTIZER_BITS) - 1;
+    }
+    shrink(first.lo, first.hi, first.count, counts);
+    if (first.count == 0)
+        boxes.clear();
+    while (boxes.size() < 255) {
+        unsigned int best = 0, axis = 0;
+        uint64_t bestScore = 0;
+        for (unsigned int i = 0; i < boxes.size(); ++i) {
+            for (unsigned int c = 0; c < 3; ++c) {
+                uint64_t score = boxes[i].count * (boxes[i].hi[c] - boxes[i].lo[c]);
+                if (score > bestScore) {
+                    best = i;
+                    axis = c;
+                    bestScore = score;
+                }
+            }
+        }
+        if (bestScore == 0)
+            break; //every box is down to a single cell
+
+        //Pixels per plane across the axis; both end planes are in use, so
+        //any cut below the top leaves pixels on either side
+        Box &box = boxes[best];
+        uint64_t planes[1 << QUANTIZER_BITS] = {0};
+        forEachCell(box.lo, box.hi, [&](unsigned int cell, const unsigned int *c) {
+            planes[c[axis]] += counts[cell];
+        });
+        unsigned int cut = box.lo[axis];
+        uint64_t below = planes[cut];
+        while (cut + 1 < box.hi[axis] && below * 2 < box.count)
+            below += planes[++cut];
+
+        Box upper = box;
+        box.hi[axis] = cut;
+        upper.lo[axis] = cut + 1;
+        shrink(box.lo, box.hi, box.count, counts);
+        shrink(upper.lo, upper.hi, upper.count, counts);
+        boxes.push_back(upper);
+    }
+
+    //Each box becomes the average of its pixels
+    for (unsigned int i = 0; i < boxes.size(); ++i) {
+        uint64_t total[3] = {0, 0, 0};
+        forEachCell(boxes[i].lo, boxes[i].hi, [&](unsigned int cell, const unsigned int *) {
+            for (unsigned int c = 0; c < 3; ++c)
+                total[c] += sums[cell * 3 + c];
+        });
+        for (unsigned int c = 0; c < 3; ++c)
+            palette.push_back(static_cast<uint8_t>((total[c] + boxes[i].count / 2) / boxes[i].count));
+    }
+
+    //Every used cell looks up the palette color nearest its average; the
+    //others are never needed for this image
+    lookup.assign(QUANTIZER_CELLS, 1);
+    unsigned int colors = palette.size() / 3;
+    for (unsigned int cell = 0; cell < QUANTIZER_CELLS; ++cell) {
+        if (counts[cell] == 0)
+            continue;
+        int mean[3];
+        for (unsigned int c = 0; c < 3; ++c)
+            mean[c] = static_cast<int>((sums[cell * 3 + c] + counts[cell] / 2) / counts[cell]);
+        unsigned int bestDistance = ~0u;
+        for (unsigned int i = 1; i < colors; ++i) {
+            unsigned int distance = 0;
+            for (unsigned int c = 0; c < 3; ++c) {
+                int d = mean[c] - palette[i * 3 + c];
+                distance += d * d;
+            }
+            if (distance < bestDistance) {
+                lookup[cell] = i;
+                bestDistance = distance;
+            }
+        }
+    }
+}
+
+void Quantizer::apply(uint8_t *dst, const uint8_t *src, size_t n) const
+{
+    if (!exact) {
+        for (size_t i = 0; i < n; ++i, src += 4)
+            dst[i] = src[3] < 128 ? 0 : lookup[cellOf(src)];
+        return;
+    }
+
+    //Runs of one color are common, so remember the last one
+    uint32_t last = ~0u;
+    uint8_t lastIndex = 0;
+    for (size_t i = 0; i < n; ++i, src += 4) {
+        if (src[3] < 128) {
+            dst[i] = 0;
+            continue;
+        }
+        uint32_t color = (src[0] << 16) | (src[1] << 8) | src[2];
+        if (color != last) {
+            int found = findExact(color);
+            last = color;
+            lastIndex = found < 0 ? 1 : found;
+        }
+        dst[i] = lastIndex;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef QUANTIZER_H
+#define QUANTIZER_H
+
+#include <stdint.h>
+
+#include <cstddef>
+
+#include <vector>
+
+class RgbaBitmap;
+
+#define QUANTIZER_BITS 5 //per channel, for the histogram and lookup table
+#define QUANTIZER_CELLS (1 << (QUANTIZER_BITS * 3))
+
+//Picks a palette of at most 256 colors for a truecolor image and maps its
+//pixels onto it. Index 0 is the transparent key: every pixel with alpha below
+//128 gets it and no other pixel does, and it takes the color of the first
+//such pixel (the tRNS key of an RGB PNG comes out as exactly that). Images
+//with no more than 255 opaque colors keep them exactly, in order of first
+//appearance; larger ones are reduced by median cut over a histogram, and
+//mapped through a table holding the nearest palette color for each of its
+//cells.
+class Quantizer
+{
+public:
+    /* constructors and destructors */
+    explicit Quantizer(const RgbaBitmap &image);
+
+    //Accessors
+    const std::vector<uint8_t> &getPalette() const { return palette; }
+    //Whether every color was kept
+    bool isExact() const { return exact; }
+
+    //Maps n RGBA pixels from src to indices in dst
+    void apply(uint8_t *dst, const uint8_t *src, size_t n) const;
+
+private:
+    struct Box;
+
+    bool collectExact(const RgbaBitmap &image);
+    void medianCut(const RgbaBitmap &image);
+    int findExact(uint32_t color) const;
+
+    bool exact;
+    std::vector<uint8_t> palette;
+    std::vector<uint32_t> keys; //exact colors, open addressing; 0 is empty
+    std::vector<uint8_t> values;
+    std::vector<uint8_t> lookup; //QUANTIZER_CELLS entries, median cut only
+};
+
+#endif // QUANTIZER_H
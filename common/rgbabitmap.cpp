@@ -0,0 +1,239 @@
+#include "rgbabitmap.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#include <immintrin.h>
+#define RGBABITMAP_HAVE_AVX2
+#endif
+#endif
+
+#include "os.h"
+#include "util.h"
+#include "bitmap.h"
+#include "outputtree.h"
+#include "imagestream.h"
+#include "bufferpool.h"
+#include "imageutil.h"
+
+//Expansion of a single row: every index of src becomes its RGBA entry in lut
+typedef void (*ExpandRow)(uint8_t *dst, const uint8_t *src, size_t n, const uint32_t *lut);
+
+static void expandRowScalar(uint8_t *dst, const uint8_t *src, size_t n, const uint32_t *lut)
+{
+    for (size_t i = 0; i < n; ++i)
+        memcpy(dst + i * 4, &lut[src[i]], 4);
+}
+
+#ifdef RGBABITMAP_HAVE_AVX2
+//Eight pixels at a time, gathered straight from the table
+__attribute__((target("avx2")))
+static void expandRowAvx2(uint8_t *dst, const uint8_t *src, size_t n, const uint32_t *lut)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        __m256i colors = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut), indices, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), colors);
+    }
+    expandRowScalar(dst + i * 4, src + i, n - i, lut);
+}
+#endif
+
+static ExpandRow chooseExpandRow()
+{
+#ifdef RGBABITMAP_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return expandRowAvx2;
+#endif
+    return expandRowScalar;
+}
+
+//One pixel of "source over" with straight (not premultiplied) alpha
+static void compositePixel(uint8_t *dst, const uint8_t *src)
+{
+    unsigned int sa = src[3];
+    if (sa == 255) {
+        memcpy(dst, src, 4);
+        return;
+    }
+    if (sa == 0)
+        return;
+
+    //Everything below is scaled by 255 * 255
+    unsigned int da = dst[3] * (255 - sa);
+    unsigned int a = sa * 255 + da;
+    for (unsigned int c = 0; c < 3; ++c)
+        dst[c] = (src[c] * sa * 255 + dst[c] * da + a / 2) / a;
+    dst[3] = (a + 127) / 255;
+}
+
+static void compositeRow(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    //Four pixels at a time while alpha is all or nothing, as it is for
+    //expanded indexed images
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        __m128i sa = _mm_and_si128(s, alpha);
+        __m128i opaque = _mm_cmpeq_epi32(sa, alpha);
+        if (_mm_movemask_epi8(_mm_or_si128(opaque, _mm_cmpeq_epi32(sa, zero))) != 0xFFFF) {
+            for (unsigned int j = 0; j < 4; ++j)
+                compositePixel(dst + (i + j) * 4, src + (i + j) * 4);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i * 4));
+        d = _mm_or_si128(_mm_and_si128(opaque, s), _mm_andnot_si128(opaque, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), d);
+    }
+#endif
+    for (; i < n; ++i)
+        compositePixel(dst + i * 4, src + i * 4);
+}
+
+/* constructors and destructors */
+RgbaBitmap::RgbaBitmap() :
+    width(0), height(0), stride(0), data(NULL), capacity(0)
+{
+}
+
+RgbaBitmap::RgbaBitmap(unsigned int width, unsigned int height) :
+    width(0), height(0), stride(0), data(NULL), capacity(0)
+{
+    allocate(width, height, true);
+}
+
+RgbaBitmap::RgbaBitmap(const BitmapView &indexed, const std::vector<uint8_t> &palette, bool transparent) :
+    width(0), height(0), stride(0), data(NULL), capacity(0)
+{
+    allocate(indexed.getWidth(), indexed.getHeight(), false);
+    expand(0, 0, indexed, 0, 0, width, height, palette, transparent);
+}
+
+RgbaBitmap::RgbaBitmap(const BitmapView &indexed, bool transparent) :
+    width(0), height(0), stride(0), data(NULL), capacity(0)
+{
+    allocate(indexed.getWidth(), indexed.getHeight(), false);
+    expand(0, 0, indexed, 0, 0, width, height, indexed.getPalette(), transparent);
+}
+
+RgbaBitmap::RgbaBitmap(const RgbaBitmap &other) :
+    width(0), height(0), stride(0), data(NULL), capacity(0)
+{
+    allocate(other.width, other.height, false);
+    for (unsigned int y = 0; y < height; ++y)
+        memcpy(getRow(y), other.getRow(y), static_cast<size_t>(width) * 4);
+}
+
+RgbaBitmap::~RgbaBitmap()
+{
+    BufferPool::get().release(data, capacity);
+}
+
+RgbaBitmap &RgbaBitmap::operator=(const RgbaBitmap &other)
+{
+    if (&other != this) {
+        RgbaBitmap copy(other);
+        swap(copy);
+    }
+    return *this;
+}
+
+void RgbaBitmap::allocate(unsigned int width, unsigned int height, bool clear)
+{
+    size_t newStride = (static_cast<size_t>(width) * 4 + BITMAP_ALIGNMENT - 1) / BITMAP_ALIGNMENT * BITMAP_ALIGNMENT;
+    BufferPool::get().release(data, capacity);
+    data = NULL;
+    capacity = 0;
+    if (newStride * height > 0)
+        data = BufferPool::get().acquire(newStride * height, clear, capacity);
+
+    this->width = width;
+    this->height = height;
+    stride = newStride;
+}
+
+void RgbaBitmap::swap(RgbaBitmap &other)
+{
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    std::swap(stride, other.stride);
+    std::swap(data, other.data);
+    std::swap(capacity, other.capacity);
+}
+
+void RgbaBitmap::expand(int mX, int mY, const BitmapView &other, int oX, int oY, int oW, int oH,
+                        const std::vector<uint8_t> &palette, bool transparent)
+{
+    if (!clipBlit(mX, mY, oX, oY, oW, oH, other.getWidth(), other.getHeight(), width, height))
+        return;
+
+    //The palette as ready-made pixels
+    uint32_t lut[256];
+    for (unsigned int i = 0; i < 256; ++i) {
+        uint8_t color[4] = {0, 0, 0, 255};
+        for (unsigned int c = 0; c < 3; ++c)
+            color[c] = i * 3 + c < palette.size() ? palette[i * 3 + c] : 0;
+        if (transparent && i == 0)
+            color[3] = 0;
+        memcpy(&lut[i], color, 4);
+    }
+
+    static const ExpandRow expandRow = chooseExpandRow();
+    for (int y = 0; y < oH; ++y)
+        expandRow(getRow(mY + y) + mX * 4, other.getRow(oY + y) + oX, oW, lut);
+}
+
+void RgbaBitmap::composite(const RgbaBitmap &other)
+{
+    if (other.width != width || other.height != height)
+        throw std::runtime_error("composite of images of different sizes");
+    for (unsigned int y = 0; y < height; ++y)
+        compositeRow(getRow(y), other.getRow(y), width);
+}
+
+void RgbaBitmap::writeToPng(const std::string &filename, unsigned int scale) const
+{
+    writeAndClose(openForWriting(filename), filename,
+                  [&](FILE *file) { writeToPng(file, scale); });
+}
+
+void RgbaBitmap::writeToPng(OutputTree &tree, const std::string &filename, unsigned int scale) const
+{
+    writeAndClose(tree.create(filename), tree.getRoot() + filename,
+                  [&](FILE *file) { writeToPng(file, scale); });
+}
+
+void RgbaBitmap::writeToPng(FILE *file, unsigned int scale) const
+{
+    if (scale == 0 || scale > BITMAP_MAX_SCALE)
+        throw std::runtime_error("invalid scale");
+
+    PngWriter png(file, width * scale, height * scale);
+    std::vector<uint32_t> scaled(scale == 1 ? 0 : static_cast<size_t>(width) * scale);
+    for (unsigned int y = 0; y < height; ++y) {
+        const uint8_t *row = getRow(y);
+        if (scale > 1) {
+            //Whole pixels at a time
+            for (unsigned int x = 0; x < width; ++x) {
+                uint32_t pixel;
+                memcpy(&pixel, row + x * 4, 4);
+                std::fill_n(&scaled[x * scale], scale, pixel);
+            }
+            row = reinterpret_cast<const uint8_t*>(scaled.data());
+        }
+        for (unsigned int j = 0; j < scale; ++j)
+            png.writeRow(row);
+    }
+    png.finish();
+}
@@ -0,0 +1,65 @@
+#ifndef RGBABITMAP_H
+#define RGBABITMAP_H
+
+#include <stdint.h>
+
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+class OutputTree;
+class BitmapView;
+
+//A truecolor image with real alpha, 4 bytes per pixel in R, G, B, A order.
+//Rows are aligned like a Bitmap's and come from the same BufferPool.
+class RgbaBitmap
+{
+public:
+    /* constructors and destructors */
+    RgbaBitmap();
+    //Fully transparent
+    RgbaBitmap(unsigned int width, unsigned int height);
+    //Expands an indexed image through palette; with transparent, index 0 gets
+    //alpha 0 and every other index alpha 255
+    RgbaBitmap(const BitmapView &indexed, const std::vector<uint8_t> &palette, bool transparent);
+    RgbaBitmap(const BitmapView &indexed, bool transparent);
+    RgbaBitmap(const RgbaBitmap &other);
+    ~RgbaBitmap();
+    RgbaBitmap &operator=(const RgbaBitmap &other);
+
+    //Accessors
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    size_t getStride() const { return stride; }
+    uint8_t *getRow(unsigned int y) { return data + y * stride; }
+    const uint8_t *getRow(unsigned int y) const { return data + y * stride; }
+
+    bool empty() const { return width == 0 || height == 0; }
+
+    //Expands the indexed rectangle (oX, oY, oW, oH) of other to (mX, mY),
+    //clipped to both images; as in the constructor for transparent
+    void expand(int mX, int mY, const BitmapView &other, int oX, int oY, int oW, int oH,
+                const std::vector<uint8_t> &palette, bool transparent);
+
+    //Lays other over this image ("source over"), both the same size
+    void composite(const RgbaBitmap &other);
+
+    //Write to file, optionally enlarged by a whole factor (every pixel
+    //repeated scale times across and down)
+    void writeToPng(const std::string &filename, unsigned int scale = 1) const;
+    void writeToPng(OutputTree &tree, const std::string &filename, unsigned int scale = 1) const;
+    //Write to an open file, which the caller closes
+    void writeToPng(FILE *file, unsigned int scale = 1) const;
+
+private:
+    void allocate(unsigned int width, unsigned int height, bool clear);
+    void swap(RgbaBitmap &other);
+
+    unsigned int width, height;
+    size_t stride;
+    uint8_t *data;
+    size_t capacity; //as handed out by the BufferPool
+};
+
+#endif // RGBABITMAP_H
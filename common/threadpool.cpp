@@ -0,0 +1,78 @@
+#include "threadpool.h"
+
+/* constructors and destructors */
+ThreadPool::ThreadPool(unsigned int threads) :
+    busy(0), stopping(false)
+{
+    if (threads == 0)
+        threads = defaultThreads();
+    workers.reserve(threads);
+    for (unsigned int i = 0; i < threads; ++i)
+        workers.push_back(std::thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    taskReady.notify_all();
+    for (unsigned int i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+void ThreadPool::run(const std::function<void()> &task)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+    taskReady.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!tasks.empty() || busy != 0)
+        allDone.wait(lock);
+    if (error) {
+        std::exception_ptr e = error;
+        error = std::exception_ptr();
+        std::rethrow_exception(e);
+    }
+}
+
+unsigned int ThreadPool::defaultThreads()
+{
+    unsigned int threads = std::thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+void ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        while (tasks.empty() && !stopping)
+            taskReady.wait(lock);
+        if (tasks.empty())
+            return;
+
+        std::function<void()> task = tasks.front();
+        tasks.pop_front();
+        ++busy;
+        lock.unlock();
+        try {
+            task();
+        } catch (...) {
+            lock.lock();
+            if (!error)
+                error = std::current_exception();
+            lock.unlock();
+        }
+        lock.lock();
+        --busy;
+        if (tasks.empty() && busy == 0)
+            allDone.notify_all();
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Fixed set of worker threads draining a shared task queue. The first
+//exception thrown by a task is rethrown from wait().
+class ThreadPool
+{
+public:
+    /* constructors and destructors */
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    void run(const std::function<void()> &task);
+    void wait();
+
+    unsigned int size() const { return workers.size(); }
+
+    //Number of hardware threads, at least 1
+    static unsigned int defaultThreads();
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    void work();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+    std::condition_variable taskReady;
+    std::condition_variable allDone;
+    unsigned int busy;
+    bool stopping;
+    std::exception_ptr error;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,238 @@
+#include "trash.h"
+
+#if defined OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cerrno>
+#endif
+
+#include <sstream>
+
+#include "util.h"
+
+#define TRASH_NAME ".rpgtools-trash-"
+
+/* constructors and destructors */
+Trash::~Trash()
+{
+    try {
+        wait();
+    } catch (...) {
+        //Leftovers are harmless; nothing sensible to report from here
+    }
+}
+
+void Trash::add(const std::string &path)
+{
+    //Strip the trailing separator so the tree itself gets renamed
+    std::string tree = path;
+    while (tree.size() > 1 && (*tree.rbegin() == '/' || *tree.rbegin() == PATH_SEPARATOR[0]))
+        tree.erase(tree.size() - 1);
+
+    if (count == 0 && inPlace.empty())
+        Util::mkdir(trashPath);
+
+    std::ostringstream target;
+    target << trashPath << count;
+#if defined OS_W32
+    bool moved = MoveFileW(W32::toWide(tree).c_str(), W32::toWide(target.str()).c_str());
+#else
+    bool moved = rename(tree.c_str(), target.str().c_str()) == 0;
+#endif
+    if (moved) {
+        ++count;
+        queue(target.str());
+    } else {
+        //Probably a different filesystem; delete it where it is
+        inPlace.push_back(tree);
+        queue(tree);
+    }
+}
+
+void Trash::wait()
+{
+    if (!pool)
+        return;
+    pool->wait();
+    if (count > 0 || !inPlace.empty()) {
+#if defined OS_W32
+        RemoveDirectoryW(W32::toWide(trashPath).c_str());
+#else
+        rmdir(trashPath.c_str());
+#endif
+    }
+    count = 0;
+    inPlace.clear();
+}
+
+#if defined OS_W32
+
+Trash::Trash(const std::string &dirname, unsigned int threads) :
+    threads(threads),
+    count(0),
+    cancelled(false)
+{
+    std::ostringstream path;
+    path << dirname << TRASH_NAME << GetCurrentProcessId() << PATH_SEPARATOR;
+    trashPath = path.str();
+}
+
+void Trash::queue(const std::string &path)
+{
+    if (!pool)
+        pool.reset(new ThreadPool(threads));
+    pool->run([=]() { Util::deleteFolder(path); });
+}
+
+void Trash::detach()
+{
+    //No fork(); the caller has to sit it out
+    wait();
+}
+
+#elif defined OS_UNIX
+
+Trash::Trash(const std::string &dirname, unsigned int threads) :
+    threads(threads),
+    count(0),
+    cancelled(false)
+{
+    std::ostringstream path;
+    path << dirname << TRASH_NAME << getpid() << PATH_SEPARATOR;
+    trashPath = path.str();
+}
+
+void Trash::queue(const std::string &path)
+{
+    if (!pool)
+        pool.reset(new ThreadPool(threads));
+    //No trailing separator, so O_NOFOLLOW applies to the tree itself
+    std::string tree = path;
+    while (tree.size() > 1 && *tree.rbegin() == '/')
+        tree.erase(tree.size() - 1);
+
+    std::shared_ptr<Node> node(new Node);
+    node->path = tree;
+    node->pending = 1;
+    pool->run([=]() { removeDir(node); });
+}
+
+//Unlinks the files of one directory and queues its subdirectories
+void Trash::removeDir(const std::shared_ptr<Node> &node)
+{
+    if (cancelled)
+        return;
+
+    //A file or a symlink put in the trash is unlinked itself. A link to a
+    //directory is never followed into its target.
+    struct stat st;
+    if (!node->parent && lstat(node->path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+        unlink(node->path.c_str());
+        return;
+    }
+
+    int fd = open(node->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 && (errno == ENOTDIR || errno == ELOOP)) {
+        //Replaced by something else since it was listed
+        unlink(node->path.c_str());
+        release(node->parent);
+        return;
+    }
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        release(node);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && !cancelled) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        bool isDir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            isDir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if (isDir) {
+            std::shared_ptr<Node> child(new Node);
+            child->path = node->path + PATH_SEPARATOR + name;
+            child->parent = node;
+            child->pending = 1;
+            ++node->pending;
+            pool->run([=]() { removeDir(child); });
+        } else {
+            unlinkat(fd, name, 0);
+        }
+    }
+    closedir(dir);
+    release(node);
+}
+
+//Drops one reference to node; the last one removes the (now empty) directory
+void Trash::release(std::shared_ptr<Node> node)
+{
+    while (node && --node->pending == 0) {
+        rmdir(node->path.c_str());
+        node = node->parent;
+    }
+}
+
+void Trash::detach()
+{
+    if (count == 0 && inPlace.empty())
+        return;
+
+    //Stop the workers; fork() must not happen with other threads running
+    cancelled = true;
+    pool->wait();
+    pool.reset();
+    cancelled = false;
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(NULL);
+
+    //Double fork so the cleaner is reparented and never becomes a zombie
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            setsid();
+            int null = open("/dev/null", O_RDWR);
+            if (null >= 0) {
+                dup2(null, 0);
+                dup2(null, 1);
+                dup2(null, 2);
+                close(null);
+            }
+            for (unsigned int i = 0; i < inPlace.size(); ++i)
+                queue(inPlace[i]);
+            queue(trashPath);
+            pool->wait();
+        }
+        _exit(0);
+    }
+
+    if (pid > 0 && waitpid(pid, NULL, 0) == pid) {
+        //The child owns the cleanup now
+        count = 0;
+        inPlace.clear();
+        return;
+    }
+
+    //Could not fork; finish the job here
+    for (unsigned int i = 0; i < inPlace.size(); ++i)
+        queue(inPlace[i]);
+    queue(trashPath);
+    wait();
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef TRASH_H
+#define TRASH_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "os.h"
+#include "threadpool.h"
+
+//Deletes directory trees and files off the critical path. Each tree is renamed into a
+//trash directory on the same filesystem, so it disappears from its old place
+//immediately, and is then removed by worker threads in the background.
+class Trash
+{
+public:
+    /* constructors and destructors */
+    //The trash directory is created inside dirname (ending with a separator)
+    explicit Trash(const std::string &dirname, unsigned int threads = 0);
+    ~Trash();
+
+    //Move a tree (or a single file) into the trash and start deleting it
+    void add(const std::string &path);
+
+    //Block until everything in the trash is gone
+    void wait();
+
+    //Return without waiting. On Unix the remaining work is handed to a
+    //detached child process; elsewhere this is the same as wait().
+    void detach();
+
+private:
+    Trash(const Trash &);
+    Trash &operator=(const Trash &);
+
+    void queue(const std::string &path);
+
+#if defined OS_UNIX
+    struct Node
+    {
+        std::string path;
+        std::shared_ptr<Node> parent;
+        std::atomic<unsigned int> pending;
+    };
+
+    void removeDir(const std::shared_ptr<Node> &node);
+    void release(std::shared_ptr<Node> node);
+#endif
+
+    std::string trashPath;
+    unsigned int threads;
+    unsigned int count;
+    std::vector<std::string> inPlace; //trees that could not be moved
+    std::atomic<bool> cancelled;
+    std::unique_ptr<ThreadPool> pool;
+};
+
+#endif // TRASH_H
@@ -1,4 +1,5 @@
 #include "util.h"
+#include "fileview.h"
 
 #if defined OS_W32
 #include <shellapi.h>
@@ -7,18 +8,32 @@
 #include <sys/stat.h>
 #include <ftw.h>
 #include <dirent.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <unistd.h>
-#ifndef NOUCONV
-#include <unicode/ucsdet.h>
-#include <unicode/ucnv.h>
-#include <unicode/ustring.h>
+#include <cerrno>
+#ifdef OS_LINUX
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #endif
+#ifdef UCONV
+#include "cp932.h"
+#include "lowercase.h"
+#endif
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #include <stdexcept>
 #include <algorithm>
 #include <cassert>
 
+#include "threadpool.h"
+
+#define COPY_BUFFER_SIZE (128 * 1024)
+
 namespace Util
 {
 /* PRIVATE FUNCS */
@@ -63,6 +78,12 @@ bool dirExists(const std::string &dirname)
     return attrib != INVALID_FILE_ATTRIBUTES && (attrib & FILE_ATTRIBUTE_DIRECTORY);
 }
 
+bool fileExists(const std::string &filename)
+{
+    DWORD attrib = GetFileAttributesW(W32::toWide(filename).c_str());
+    return attrib != INVALID_FILE_ATTRIBUTES && !(attrib & FILE_ATTRIBUTE_DIRECTORY);
+}
+
 std::vector<std::string> listFiles(const std::string &path)
 {
     assert(*path.rbegin() == PATH_SEPARATOR[0]);
@@ -80,6 +101,53 @@ std::vector<std::string> listFiles(const std::string &path)
     return list;
 }
 
+static void listEntries(const std::string &realpath, const std::string &prefix, bool recursive,
+                        std::vector<DirEntry> &list)
+{
+    WIN32_FIND_DATAW fd;
+    HANDLE hFind = NULL;
+
+    if ((hFind = FindFirstFileW(W32::toWide(realpath + "*").c_str(), &fd)) == INVALID_HANDLE_VALUE)
+        throw std::runtime_error(realpath + ": could not list files");
+    try {
+        do {
+            if (isDotOrDotDot(fd.cFileName))
+                continue;
+
+            DirEntry entry;
+            entry.name = prefix + W32::fromWide(fd.cFileName);
+            entry.size = 0;
+            entry.mtime = 0;
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                entry.type = DirEntry::Directory;
+            } else {
+                entry.type = DirEntry::File;
+                entry.size = (static_cast<uint64_t>(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+                uint64_t time = (static_cast<uint64_t>(fd.ftLastWriteTime.dwHighDateTime) << 32)
+                        | fd.ftLastWriteTime.dwLowDateTime;
+                entry.mtime = static_cast<int64_t>(time / 10000000) - 11644473600LL;
+            }
+            list.push_back(entry);
+
+            if (recursive && entry.type == DirEntry::Directory)
+                listEntries(realpath + W32::fromWide(fd.cFileName) + PATH_SEPARATOR,
+                            entry.name + PATH_SEPARATOR, true, list);
+        } while(FindNextFileW(hFind, &fd));
+    } catch (...) {
+        FindClose(hFind);
+        throw;
+    }
+    FindClose(hFind);
+}
+
+std::vector<DirEntry> listEntries(const std::string &path, bool recursive)
+{
+    assert(*path.rbegin() == PATH_SEPARATOR[0]);
+    std::vector<DirEntry> list;
+    listEntries(path, "", recursive, list);
+    return list;
+}
+
 size_t getFileSize(const std::string &filename)
 {
     //TODO getFileSize windows
@@ -96,11 +164,23 @@ size_t getFileSize(const std::string &filename)
     return static_cast<size_t>(size.QuadPart);
 }
 
+void copyFile(const std::string &src, const std::string &dst)
+{
+    //CopyFileW already does the copy in the kernel (and clones on ReFS)
+    if (!CopyFileW(W32::toWide(src).c_str(), W32::toWide(dst).c_str(), FALSE))
+        throw std::runtime_error(src + ": could not copy to " + dst);
+}
+
 void deleteFile(const std::string &filename)
 {
     DeleteFileW(W32::toWide(filename).c_str());
 }
 
+bool deleteEmptyFolder(const std::string &dirname)
+{
+    return RemoveDirectoryW(W32::toWide(dirname).c_str()) != 0;
+}
+
 void deleteFolder(const std::string &filename)
 {
     std::wstring wfilename = W32::toWide(filename);
@@ -166,6 +246,12 @@ bool dirExists(const std::string &dirname)
     return stat(dirname.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
 }
 
+bool fileExists(const std::string &filename)
+{
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
 std::vector<std::string> listFiles(const std::string &path)
 {
     assert(*path.rbegin() == PATH_SEPARATOR[0]);
@@ -186,6 +272,79 @@ std::vector<std::string> listFiles(const std::string &path)
     return list;
 }
 
+//Takes ownership of fd. Only files (and entries whose d_type doesn't tell us
+//what they are) are stat'd, relative to the open directory.
+static void listEntriesAt(int fd, const std::string &realpath, const std::string &prefix, bool recursive,
+                          std::vector<DirEntry> &list)
+{
+    DIR *dp = fdopendir(fd);
+    if (dp == NULL) {
+        close(fd);
+        throw std::runtime_error(realpath + ": could not list files");
+    }
+
+    try {
+        dirent *ep;
+        while ((ep = readdir(dp)) != NULL) {
+            if (isDotOrDotDot(ep->d_name))
+                continue;
+
+            DirEntry entry;
+            entry.name = prefix + ep->d_name;
+            entry.type = DirEntry::Other;
+            entry.size = 0;
+            entry.mtime = 0;
+
+            bool needStat = true;
+#ifdef _DIRENT_HAVE_D_TYPE
+            if (ep->d_type == DT_DIR) {
+                entry.type = DirEntry::Directory;
+                needStat = false;
+            } else if (ep->d_type != DT_REG && ep->d_type != DT_LNK && ep->d_type != DT_UNKNOWN) {
+                needStat = false;
+            }
+#endif
+            if (needStat) {
+                //Follow symlinks, like stat() did
+                struct stat st;
+                if (fstatat(dirfd(dp), ep->d_name, &st, 0) != 0)
+                    continue;
+                if (S_ISDIR(st.st_mode)) {
+                    entry.type = DirEntry::Directory;
+                } else if (S_ISREG(st.st_mode)) {
+                    entry.type = DirEntry::File;
+                    entry.size = st.st_size;
+                    entry.mtime = st.st_mtime;
+                }
+            }
+            list.push_back(entry);
+
+            if (recursive && entry.type == DirEntry::Directory) {
+                int subfd = openat(dirfd(dp), ep->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (subfd < 0)
+                    throw std::runtime_error(realpath + ep->d_name + ": could not list files");
+                listEntriesAt(subfd, realpath + ep->d_name + PATH_SEPARATOR, entry.name + PATH_SEPARATOR, true, list);
+            }
+        }
+    } catch (...) {
+        closedir(dp);
+        throw;
+    }
+    closedir(dp);
+}
+
+std::vector<DirEntry> listEntries(const std::string &path, bool recursive)
+{
+    assert(*path.rbegin() == PATH_SEPARATOR[0]);
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(path + ": could not list files");
+
+    std::vector<DirEntry> list;
+    listEntriesAt(fd, path, "", recursive, list);
+    return list;
+}
+
 size_t getFileSize(const std::string &filename)
 {
     struct stat st;
@@ -193,11 +352,112 @@ size_t getFileSize(const std::string &filename)
     return st.st_size;
 }
 
+//Copies the remainder of in to out starting at done, without going through
+//userspace where the kernel allows. Returns false if no kernel path applies.
+static bool copyFileKernel(int in, int out, uint64_t &done, uint64_t size)
+{
+#ifdef FICLONE
+    //Reflink: shares extents on btrfs/XFS, no data copied at all
+    if (done == 0 && ioctl(out, FICLONE, in) == 0) {
+        done = size;
+        return true;
+    }
+#endif
+#ifdef OS_LINUX
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while (done < size) {
+        loff_t offIn = done, offOut = done;
+        ssize_t n = copy_file_range(in, &offIn, out, &offOut, size - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; //EXDEV, ENOSYS, EINVAL...: try the next method
+        done += n;
+    }
+    if (done == size)
+        return true;
+#endif
+    off_t offset = done;
+    if (lseek(out, done, SEEK_SET) < 0)
+        return false;
+    while (done < size) {
+        ssize_t n = sendfile(out, in, &offset, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done == size;
+#else
+    UNUSED(in);
+    UNUSED(out);
+    return done == size;
+#endif
+}
+
+void copyFile(const std::string &src, const std::string &dst)
+{
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        throw std::runtime_error(src + ": could not open file");
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        throw std::runtime_error(src + ": could not get file size");
+    }
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0) {
+        close(in);
+        throw std::runtime_error(dst + ": could not open file for writing");
+    }
+
+    uint64_t done = 0;
+    uint64_t size = st.st_size;
+    bool success = copyFileKernel(in, out, done, size);
+
+    //Fall back to a plain read/write loop
+    if (!success && lseek(in, done, SEEK_SET) >= 0 && lseek(out, done, SEEK_SET) >= 0) {
+        std::vector<char> buffer(COPY_BUFFER_SIZE);
+        for (;;) {
+            ssize_t n = read(in, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                success = n == 0;
+                break;
+            }
+            ssize_t written = 0;
+            while (written < n) {
+                ssize_t m = write(out, buffer.data() + written, n - written);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m <= 0)
+                    break;
+                written += m;
+            }
+            if (written < n)
+                break;
+        }
+    }
+
+    close(in);
+    if (close(out) != 0)
+        success = false;
+    if (!success)
+        throw std::runtime_error(src + ": could not copy to " + dst);
+}
+
 void deleteFile(const std::string &filename)
 {
     unlink(filename.c_str());
 }
 
+bool deleteEmptyFolder(const std::string &dirname)
+{
+    return rmdir(dirname.c_str()) == 0;
+}
+
 int deleteFolder_func(const char *filename, const struct stat *st, int flags, struct FTW *fwt)
 {
     UNUSED(st);
@@ -238,18 +498,30 @@ std::string getWithoutExtension(const std::string &filename)
 
 std::string readFileContents(const std::string &filename)
 {
-    size_t size = Util::getFileSize(filename);
-    ifstream file(filename.c_str());
-    std::vector<char> data(size);
-    file.read(data.data(), size);
-    return std::string(data.begin(), data.end());
+    FileView view(filename);
+    return std::string(view.begin(), view.end());
 }
 
-void copyFile(const std::string &src, const std::string &dst)
+void copyTree(const std::string &src, const std::string &dst, unsigned int threads)
 {
-    ifstream fsrc(src.c_str());
-    ofstream fdst(dst.c_str());
-    fdst << fsrc.rdbuf();
+    std::vector<DirEntry> entries = listEntries(src, true);
+
+    //Create the directory structure up front; entries are listed parents first
+    mkdir(dst);
+    for (unsigned int i = 0; i < entries.size(); ++i) {
+        if (entries[i].type == DirEntry::Directory)
+            mkdir(dst + entries[i].name);
+    }
+
+    //Copy the files
+    ThreadPool pool(threads);
+    for (unsigned int i = 0; i < entries.size(); ++i) {
+        if (entries[i].type == DirEntry::File) {
+            std::string name = entries[i].name;
+            pool.run([=]() { copyFile(src + name, dst + name); });
+        }
+    }
+    pool.wait();
 }
 
 /******************
@@ -292,81 +564,197 @@ static std::string encode(const std::string &string, int from, int to, bool tolo
 }
 #else
 #ifdef UCONV
-#define ENC_UTF8 "utf8"
-#define ENC_SJIS "Windows-31J"
-static std::string encode(const std::string &string, const char *from, const char *to, bool tolower)
-{
-    if (string.empty())
-        return std::string();
-
-    UConverter *conv;
-    UErrorCode status = U_ZERO_ERROR;
-    int size;
+#define ENC_UTF8 0
+#define ENC_SJIS 932
 
-    /* TO UNICODE */
-    conv = ucnv_open(from, &status);
-    if (status != U_ZERO_ERROR) {
-        ucnv_close(conv);
-        throw std::runtime_error("could not open uconv object");
+//Length of the leading run of printable ASCII (0x20-0x7E), which passes
+//through both codepages unchanged. Windows-31J swaps 0x1A, 0x1C and 0x7F, so
+//control bytes always take the table path.
+static size_t copyPrintable(std::string &out, const uint8_t *s, size_t n, bool tolower)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i below = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i upperA = _mm_set1_epi8('A' - 1);
+    const __m128i upperZ = _mm_set1_epi8('Z' + 1);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        //Bytes >= 0x80 are negative, so the signed compare catches them too
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, below), _mm_cmpeq_epi8(v, del)));
+        if (mask != 0)
+            break; //finish this block below
+        if (tolower) {
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, upperA), _mm_cmplt_epi8(v, upperZ));
+            v = _mm_or_si128(v, _mm_and_si128(upper, caseBit));
+        }
+        char buffer[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(buffer), v);
+        out.append(buffer, 16);
     }
-
-    //Calculate size
-    size = ucnv_toUChars(conv, NULL, 0, string.data(), string.size(), &status);
-    if (status != U_BUFFER_OVERFLOW_ERROR) {
-        ucnv_close(conv);
-        throw std::runtime_error("\"" + string + "\": conversion error");
+#endif
+    for (; i < n && s[i] >= 0x20 && s[i] < 0x7F; ++i)
+        out.push_back((tolower && s[i] >= 'A' && s[i] <= 'Z') ? s[i] + 32 : s[i]);
+    return i;
+}
+
+static inline uint32_t decodeSjis(const uint8_t *s, size_t n, size_t &i)
+{
+    uint8_t lead = s[i++];
+    int row = -1;
+    if (lead >= 0x81 && lead <= 0x9F)
+        row = lead - 0x81;
+    else if (lead >= 0xE0 && lead <= 0xFC)
+        row = lead - 0xE0 + 0x1F;
+    if (row >= 0 && i < n && s[i] >= 0x40 && s[i] <= 0xFC) {
+        uint16_t c = cp932DoubleByte[row][s[i] - 0x40];
+        if (c != 0) {
+            ++i;
+            return c;
+        }
     }
-
-    //Convert
-    status = U_ZERO_ERROR;
-    std::vector<UChar> ubuffer(size);
-    ucnv_toUChars(conv, ubuffer.data(), size, string.data(), string.size(), &status);
-    ucnv_close(conv);
-    if (status != U_STRING_NOT_TERMINATED_WARNING)
-        throw std::runtime_error("\"" + string + "\": conversion error");
-
-    /* TO LOWERCASE */
-    if (tolower) {
-        //Get size
-        status = U_ZERO_ERROR;
-        size = u_strToLower(NULL, 0, ubuffer.data(), ubuffer.size(), "", &status);
-        if (status != U_BUFFER_OVERFLOW_ERROR)
-            throw std::runtime_error("\"" + string + "\": could not convert to lowercase");
-
-        //Convert
-        status = U_ZERO_ERROR;
-        std::vector<UChar> ubufferMixed(size);
-        std::swap(ubuffer, ubufferMixed);
-        u_strToLower(ubuffer.data(), size, ubufferMixed.data(), ubufferMixed.size(), "", &status);
-        if (status != U_STRING_NOT_TERMINATED_WARNING)
-            throw std::runtime_error("\"" + string + "\": could not convert to lowercase");
+    //Single byte, truncated lead, or lead with a bad trail (the trail byte
+    //is then read again on its own, as ICU does)
+    return cp932SingleByte[lead];
+}
+
+//Decodes one code point; ill-formed sequences become U+FFFD, one per
+//maximal subpart (Unicode 6.0 section 3.9), as ICU does
+static inline uint32_t decodeUtf8(const uint8_t *s, size_t n, size_t &i)
+{
+    uint8_t b = s[i++];
+    if (b < 0x80)
+        return b;
+
+    uint32_t c;
+    int extra;
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (b >= 0xC2 && b <= 0xDF) {
+        c = b & 0x1F;
+        extra = 1;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        c = b & 0x0F;
+        extra = 2;
+        if (b == 0xE0)
+            lo = 0xA0;
+        else if (b == 0xED)
+            hi = 0x9F;
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        c = b & 0x07;
+        extra = 3;
+        if (b == 0xF0)
+            lo = 0x90;
+        else if (b == 0xF4)
+            hi = 0x8F;
+    } else {
+        return 0xFFFD;
     }
 
-    /* TO DESTINATION */
-    status = U_ZERO_ERROR;
-    conv = ucnv_open(to, &status);
-    if (status != U_ZERO_ERROR) {
-        ucnv_close(conv);
-        throw std::runtime_error("could not open uconv object");
+    for (; extra > 0; --extra) {
+        if (i == n || s[i] < lo || s[i] > hi)
+            return 0xFFFD;
+        c = (c << 6) | (s[i++] & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return c;
+}
+
+static inline void appendUtf8(std::string &out, uint32_t c)
+{
+    if (c < 0x80) {
+        out.push_back(c);
+    } else if (c < 0x800) {
+        out.push_back(0xC0 | (c >> 6));
+        out.push_back(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out.push_back(0xE0 | (c >> 12));
+        out.push_back(0x80 | ((c >> 6) & 0x3F));
+        out.push_back(0x80 | (c & 0x3F));
+    } else {
+        out.push_back(0xF0 | (c >> 18));
+        out.push_back(0x80 | ((c >> 12) & 0x3F));
+        out.push_back(0x80 | ((c >> 6) & 0x3F));
+        out.push_back(0x80 | (c & 0x3F));
     }
+}
+
+static inline void appendSjis(std::string &out, uint32_t c)
+{
+    uint16_t code;
+    if (c == 0xA5)
+        code = '\\'; //yen is the backslash in Shift-JIS
+    else if (c < 0x10000)
+        code = cp932EncodeBlocks[cp932EncodePages[c >> 8]][c & 0xFF];
+    else
+        code = 0xFCFC;
 
-    //Calculate size
-    status = U_ZERO_ERROR;
-    size = ucnv_fromUChars(conv, NULL, 0, ubuffer.data(), ubuffer.size(), &status);
-    if (status != U_BUFFER_OVERFLOW_ERROR) {
-        ucnv_close(conv);
-        throw std::runtime_error("\"" + string + "\": conversion error");
+    for (unsigned int i = 0; c >= 0x10000 && i < ARRAY_SIZE(cp932IgnorableRanges); ++i) {
+        if (c >= cp932IgnorableRanges[i][0] && c <= cp932IgnorableRanges[i][1])
+            code = 0xFFFF;
     }
+    if (code == 0xFFFF)
+        return; //default-ignorable; dropped
+    if (code > 0xFF)
+        out.push_back(code >> 8);
+    out.push_back(code & 0xFF);
+}
+
+//Unicode simple lowercase mapping. Unlike ICU's u_strToLower, this does not
+//apply the context-sensitive final sigma rule; toLower only feeds
+//case-insensitive name matching, where both sides get the same mapping.
+static inline uint32_t lowerChar(uint32_t c)
+{
+    if (c < 0x80)
+        return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+
+    //Find the last run starting at or before c
+    size_t lo = 0, hi = ARRAY_SIZE(lowercaseRuns);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (lowercaseRuns[mid].first <= c)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return c;
+    const LowercaseRun &run = lowercaseRuns[lo - 1];
+    uint32_t offset = c - run.first;
+    if (offset % run.stride == 0 && offset / run.stride < run.count)
+        return c + run.delta;
+    return c;
+}
 
-    //Convert
-    status = U_ZERO_ERROR;
-    std::vector<char> buffer(size);
-    size = ucnv_fromUChars(conv, buffer.data(), size, ubuffer.data(), ubuffer.size(), &status);
-    ucnv_close(conv);
-    if (status != U_STRING_NOT_TERMINATED_WARNING)
-        throw std::runtime_error("\"" + string + "\": conversion error");
+static std::string encode(const std::string &string, int from, int to, bool tolower)
+{
+    const uint8_t *s = reinterpret_cast<const uint8_t*>(string.data());
+    size_t n = string.size();
+
+    std::string out;
+    out.reserve(n + n / 2);
+    for (size_t i = 0; i < n;) {
+        i += copyPrintable(out, s + i, n - i, tolower);
+        if (i == n)
+            break;
 
-    return std::string(buffer.data(), size);
+        uint32_t c = from == ENC_SJIS ? decodeSjis(s, n, i) : decodeUtf8(s, n, i);
+        if (tolower) {
+            //The only full lowercase mapping that is not a single code point
+            if (c == 0x130) {
+                out.push_back('i');
+                c = 0x307;
+            } else {
+                c = lowerChar(c);
+            }
+        }
+        if (to == ENC_SJIS)
+            appendSjis(out, c);
+        else
+            appendUtf8(out, c);
+    }
+    return out;
 }
 #endif
 #endif
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <cstdio>
+#include <stdint.h>
 
 #include "os.h"
 
@@ -18,19 +19,39 @@
 
 namespace Util
 {
+struct DirEntry
+{
+    enum Type
+    {
+        File,
+        Directory,
+        Other,
+    };
+
+    std::string name; //relative to the listed directory
+    Type type;
+    uint64_t size; //files only
+    int64_t mtime; //files only; seconds since the Unix epoch
+};
+
 FILE *fopen(const std::string &str, const unichar *args);
 void mkdir(const std::string &dirname);
 void mkdirsForFile(const std::string &filename);
 bool dirExists(const std::string &dirname);
+bool fileExists(const std::string &filename);
 std::vector<std::string> listFiles(const std::string &path);
+std::vector<DirEntry> listEntries(const std::string &path, bool recursive = false);
 std::string getExtension(const std::string &filename);
 std::string getWithoutExtension(const std::string &filename);
 size_t getFileSize(const std::string &filename);
 void deleteFile(const std::string &filename);
 void deleteFolder(const std::string &filename);
+//Only removes dirname if it is empty; returns whether it did
+bool deleteEmptyFolder(const std::string &dirname);
 std::string readFileContents(const std::string &filename);
 std::string sanitizeDirPath(std::string path);
 void copyFile(const std::string &src, const std::string &dst);
+void copyTree(const std::string &src, const std::string &dst, unsigned int threads = 0);
 #ifdef OS_W32
 std::string sanitizePath(std::string path);
 #else
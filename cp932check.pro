@@ -0,0 +1,26 @@
+TEMPLATE = app
+CONFIG -= app_bundle qt
+CONFIG += console link_pkgconfig c++11 thread
+
+#Compares the built-in transcoder with ICU, so it is only built where ICU is
+requires(unix:packagesExist(icu-uc))
+
+PKGCONFIG += icu-uc
+DEFINES += UCONV
+
+INCLUDEPATH += common
+
+SOURCES += \
+    common/os.cpp \
+    common/util.cpp \
+    common/fileview.cpp \
+    common/threadpool.cpp \
+    cp932check/main.cpp
+
+HEADERS += \
+    common/os.h \
+    common/util.h \
+    common/cp932.h \
+    common/lowercase.h \
+    common/fileview.h \
+    common/threadpool.h
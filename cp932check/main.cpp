@@ -0,0 +1,388 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <chrono>
+
+#include <unicode/ucnv.h>
+#include <unicode/ustring.h>
+
+#include "util.h"
+
+//Checks and times Util's built-in Windows-31J/UTF-8 transcoder against the
+//ICU code it replaced. Only built where ICU is available (see cp932check.pro).
+
+/* THE OLD ICU PATH */
+#define YEN "\u00A5"
+#define ENC_UTF8 "utf8"
+#define ENC_SJIS "Windows-31J"
+
+namespace Icu
+{
+static std::string encode(const std::string &string, const char *from, const char *to, bool tolower)
+{
+    if (string.empty())
+        return std::string();
+
+    UConverter *conv;
+    UErrorCode status = U_ZERO_ERROR;
+    int size;
+
+    /* TO UNICODE */
+    conv = ucnv_open(from, &status);
+    if (status != U_ZERO_ERROR) {
+        ucnv_close(conv);
+        throw std::runtime_error("could not open uconv object");
+    }
+
+    //Calculate size
+    size = ucnv_toUChars(conv, NULL, 0, string.data(), string.size(), &status);
+    if (status != U_BUFFER_OVERFLOW_ERROR) {
+        ucnv_close(conv);
+        throw std::runtime_error("\"" + string + "\": conversion error");
+    }
+
+    //Convert
+    status = U_ZERO_ERROR;
+    std::vector<UChar> ubuffer(size);
+    ucnv_toUChars(conv, ubuffer.data(), size, string.data(), string.size(), &status);
+    ucnv_close(conv);
+    if (status != U_STRING_NOT_TERMINATED_WARNING)
+        throw std::runtime_error("\"" + string + "\": conversion error");
+
+    /* TO LOWERCASE */
+    if (tolower) {
+        //Get size
+        status = U_ZERO_ERROR;
+        size = u_strToLower(NULL, 0, ubuffer.data(), ubuffer.size(), "", &status);
+        if (status != U_BUFFER_OVERFLOW_ERROR)
+            throw std::runtime_error("\"" + string + "\": could not convert to lowercase");
+
+        //Convert
+        status = U_ZERO_ERROR;
+        std::vector<UChar> ubufferMixed(size);
+        std::swap(ubuffer, ubufferMixed);
+        u_strToLower(ubuffer.data(), size, ubufferMixed.data(), ubufferMixed.size(), "", &status);
+        if (status != U_STRING_NOT_TERMINATED_WARNING)
+            throw std::runtime_error("\"" + string + "\": could not convert to lowercase");
+    }
+
+    /* TO DESTINATION */
+    status = U_ZERO_ERROR;
+    conv = ucnv_open(to, &status);
+    if (status != U_ZERO_ERROR) {
+        ucnv_close(conv);
+        throw std::runtime_error("could not open uconv object");
+    }
+
+    //Calculate size. Input made only of dropped code points converts to
+    //nothing, which rpgconv reported as an error; call that empty here.
+    status = U_ZERO_ERROR;
+    size = ucnv_fromUChars(conv, NULL, 0, ubuffer.data(), ubuffer.size(), &status);
+    if (size == 0 && U_SUCCESS(status)) {
+        ucnv_close(conv);
+        return std::string();
+    }
+    if (status != U_BUFFER_OVERFLOW_ERROR) {
+        ucnv_close(conv);
+        throw std::runtime_error("\"" + string + "\": conversion error");
+    }
+
+    //Convert
+    status = U_ZERO_ERROR;
+    std::vector<char> buffer(size);
+    size = ucnv_fromUChars(conv, buffer.data(), size, ubuffer.data(), ubuffer.size(), &status);
+    ucnv_close(conv);
+    if (status != U_STRING_NOT_TERMINATED_WARNING)
+        throw std::runtime_error("\"" + string + "\": conversion error");
+
+    return std::string(buffer.data(), size);
+}
+
+static std::string replaceYen(std::string string)
+{
+    size_t pos = 0;
+    while ((pos = string.find(YEN, pos)) != std::string::npos) {
+        string.replace(pos, ARRAY_SIZE(YEN) - 1, "\\");
+        ++pos;
+    }
+    return string;
+}
+
+static std::string fromJis(const std::string &jstring)
+{
+    return replaceYen(encode(jstring, ENC_SJIS, ENC_UTF8, false));
+}
+
+static std::string toJis(std::string string)
+{
+    //Replace backslash with yen
+    size_t pos = 0;
+    while ((pos = string.find('\\', pos)) != std::string::npos) {
+        string.replace(pos, 1, YEN);
+        pos += ARRAY_SIZE(YEN) - 1;
+    }
+    return encode(string, ENC_UTF8, ENC_SJIS, false);
+}
+
+static std::string fromJisToLower(const std::string &jstring)
+{
+    return replaceYen(encode(jstring, ENC_SJIS, ENC_UTF8, true));
+}
+
+static std::string toLower(const std::string &string)
+{
+    return encode(string, ENC_UTF8, ENC_UTF8, true);
+}
+}
+
+/* COMPARISON */
+typedef std::string (*Conversion)(const std::string &);
+
+static std::string utilToJis(const std::string &string) { return Util::toJis(string); }
+static std::string icuToJis(const std::string &string) { return Icu::toJis(string); }
+
+struct Function
+{
+    const char *name;
+    Conversion util, icu;
+};
+
+static const Function fromSjis[] = {
+    {"fromJis", Util::fromJis, Icu::fromJis},
+    {"fromJisToLower", Util::fromJisToLower, Icu::fromJisToLower},
+};
+
+static const Function fromUtf8[] = {
+    {"toJis", utilToJis, icuToJis},
+    {"toLower", Util::toLower, Icu::toLower},
+};
+
+static std::string hex(const std::string &string)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned int i = 0; i < string.size(); ++i) {
+        if (i != 0)
+            out.push_back(' ');
+        out.push_back(digits[static_cast<uint8_t>(string[i]) >> 4]);
+        out.push_back(digits[static_cast<uint8_t>(string[i]) & 0xF]);
+    }
+    return out;
+}
+
+static std::string toUtf8(uint32_t c)
+{
+    std::string out;
+    if (c < 0x80) {
+        out.push_back(c);
+    } else if (c < 0x800) {
+        out.push_back(0xC0 | (c >> 6));
+        out.push_back(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out.push_back(0xE0 | (c >> 12));
+        out.push_back(0x80 | ((c >> 6) & 0x3F));
+        out.push_back(0x80 | (c & 0x3F));
+    } else {
+        out.push_back(0xF0 | (c >> 18));
+        out.push_back(0x80 | ((c >> 12) & 0x3F));
+        out.push_back(0x80 | ((c >> 6) & 0x3F));
+        out.push_back(0x80 | (c & 0x3F));
+    }
+    return out;
+}
+
+//Runs both sides on one input; returns whether they agree
+static bool compare(const Function &function, const std::string &input, unsigned int &mismatches)
+{
+    std::string a = function.util(input), b = function.icu(input);
+    if (a == b)
+        return true;
+    if (++mismatches <= 10) {
+        std::cerr << "  " << function.name << "(" << hex(input) << "): built-in "
+                  << hex(a) << ", ICU " << hex(b) << std::endl;
+    }
+    return false;
+}
+
+//Whether input may run into one of the documented differences from the
+//ICU path:
+//- U+00A5 encodes to the backslash byte, where ICU substituted 0xFCFC; a
+//  backslash is turned into U+00A5 first, so it is affected too
+//- the final sigma rule is not applied when lowercasing a capital sigma
+static bool hitsKnownDeviation(const Function &function, const std::string &input)
+{
+    if (function.util == utilToJis)
+        return input.find('\\') != std::string::npos || input.find(YEN) != std::string::npos;
+    if (function.util == Util::toLower)
+        return input.find("\u03A3") != std::string::npos;
+    if (function.util == Util::fromJisToLower)
+        return input.find("\x83\xB0") != std::string::npos;
+    return false;
+}
+
+//Deterministic, so failures reproduce
+static uint32_t nextRandom(uint32_t &state)
+{
+    state = state * 1103515245 + 12345;
+    return state >> 8;
+}
+
+static unsigned int checkAll()
+{
+    unsigned int unexpected = 0;
+
+    //Every 1- and 2-byte Shift-JIS sequence, including the ill-formed ones
+    for (unsigned int f = 0; f < ARRAY_SIZE(fromSjis); ++f) {
+        unsigned int mismatches = 0;
+        for (unsigned int i = 0; i < 0x10100; ++i) {
+            std::string input;
+            if (i < 0x100)
+                input.push_back(i);
+            else
+                input.append(1, (i - 0x100) >> 8).append(1, (i - 0x100) & 0xFF);
+            compare(fromSjis[f], input, mismatches);
+        }
+        std::cout << fromSjis[f].name << ": every 1- and 2-byte sequence, "
+                  << mismatches << " mismatches" << std::endl;
+        unexpected += mismatches;
+    }
+
+    //Every Unicode scalar value
+    for (unsigned int f = 0; f < ARRAY_SIZE(fromUtf8); ++f) {
+        unsigned int mismatches = 0, known = 0;
+        for (uint32_t c = 0; c <= 0x10FFFF; ++c) {
+            if (c >= 0xD800 && c <= 0xDFFF)
+                continue;
+            std::string input = toUtf8(c);
+            if (hitsKnownDeviation(fromUtf8[f], input)) {
+                std::string a = fromUtf8[f].util(input), b = fromUtf8[f].icu(input);
+                if (a != b) {
+                    std::cout << "  " << fromUtf8[f].name << "(" << hex(input) << "): built-in "
+                              << hex(a) << ", ICU " << hex(b) << " (known)" << std::endl;
+                    ++known;
+                }
+                continue;
+            }
+            compare(fromUtf8[f], input, mismatches);
+        }
+        std::cout << fromUtf8[f].name << ": every scalar value, " << mismatches
+                  << " mismatches, " << known << " known" << std::endl;
+        unexpected += mismatches;
+    }
+
+    //The final sigma rule is context-dependent, so single code points never
+    //hit it: a capital sigma ending a word lowercases to U+03C2 in ICU only
+    {
+        std::string input = "\u0391\u03A3";
+        std::string a = Util::toLower(input), b = Icu::toLower(input);
+        std::cout << "  toLower(U+0391 U+03A3): built-in " << hex(a) << ", ICU " << hex(b)
+                  << (a == b ? " (now the same)" : " (known)") << std::endl;
+    }
+
+    //Random strings, mixing ASCII runs (the SIMD path) with high bytes
+    uint32_t state = 1;
+    for (unsigned int f = 0; f < ARRAY_SIZE(fromSjis) + ARRAY_SIZE(fromUtf8); ++f) {
+        const Function &function = f < ARRAY_SIZE(fromSjis) ? fromSjis[f] : fromUtf8[f - ARRAY_SIZE(fromSjis)];
+        unsigned int mismatches = 0;
+        for (unsigned int i = 0; i < 50000; ++i) {
+            std::string input;
+            unsigned int length = nextRandom(state) % 48;
+            for (unsigned int j = 0; j < length; ++j) {
+                uint32_t r = nextRandom(state);
+                input.push_back(r % 4 == 0 ? (r >> 2) & 0xFF : 0x20 + (r >> 2) % 0x5F);
+            }
+            if (hitsKnownDeviation(function, input))
+                continue;
+            compare(function, input, mismatches);
+        }
+        std::cout << function.name << ": 50000 random strings, " << mismatches << " mismatches" << std::endl;
+        unexpected += mismatches;
+    }
+
+    return unexpected;
+}
+
+/* BENCHMARK */
+static double timeRuns(Conversion function, const std::vector<std::string> &inputs)
+{
+    //Best of five
+    double best = 0;
+    for (unsigned int run = 0; run < 5; ++run) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < inputs.size(); ++i)
+            function(inputs[i]);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (run == 0 || elapsed.count() < best)
+            best = elapsed.count();
+    }
+    return best;
+}
+
+static void benchmark()
+{
+    //Asset names as a game has them: ASCII, or kanji with an ASCII suffix
+    std::vector<std::string> sjisNames, utf8Names;
+    uint32_t state = 2;
+    for (unsigned int i = 0; i < 20000; ++i) {
+        std::string name;
+        if (i % 2 == 0) {
+            name = "Actor_";
+            for (unsigned int j = 0; j < 8; ++j)
+                name.push_back('A' + nextRandom(state) % 26);
+        } else {
+            for (unsigned int j = 0; j < 6; ++j) {
+                name.push_back(0x88 + nextRandom(state) % 0x18);
+                name.push_back(0x40 + nextRandom(state) % 0x3F);
+            }
+        }
+        name += ".PNG";
+        sjisNames.push_back(name);
+        utf8Names.push_back(Util::fromJis(name));
+    }
+
+    struct Case
+    {
+        const char *name;
+        Conversion util, icu;
+        const std::vector<std::string> *inputs;
+    } cases[] = {
+        {"toLower", Util::toLower, Icu::toLower, &utf8Names},
+        {"fromJis", Util::fromJis, Icu::fromJis, &sjisNames},
+        {"fromJisToLower", Util::fromJisToLower, Icu::fromJisToLower, &sjisNames},
+        {"toJis", utilToJis, icuToJis, &utf8Names},
+    };
+    for (unsigned int i = 0; i < ARRAY_SIZE(cases); ++i) {
+        std::cout << cases[i].name << " (20000 names): ICU " << timeRuns(cases[i].icu, *cases[i].inputs)
+                  << " ms, built-in " << timeRuns(cases[i].util, *cases[i].inputs) << " ms" << std::endl;
+    }
+}
+
+int unimain(const std::vector<std::string> &args)
+{
+    bool check = true, bench = true;
+    if (args.size() == 1 && args[0] == "--check") {
+        bench = false;
+    } else if (args.size() == 1 && args[0] == "--bench") {
+        check = false;
+    } else if (!args.empty()) {
+        std::cerr << "usage: cp932check [--check | --bench]" << std::endl;
+        return 1;
+    }
+
+    try {
+        if (check) {
+            unsigned int unexpected = checkAll();
+            if (unexpected != 0) {
+                std::cerr << "error: " << unexpected << " unexpected mismatches with ICU" << std::endl;
+                return 1;
+            }
+        }
+        if (bench)
+            benchmark();
+    } catch (std::runtime_error &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,6 +1,6 @@
 TEMPLATE = app
 CONFIG -= app_bundle qt
-CONFIG += console link_pkgconfig
+CONFIG += console link_pkgconfig c++11 thread
 
 PKGCONFIG += liblcf libpng zlib
 
@@ -8,12 +8,39 @@ INCLUDEPATH += common
 
 SOURCES += \
     common/bitmap.cpp \
+    common/imagestream.cpp \
+    common/bufferpool.cpp \
+    common/rgbabitmap.cpp \
+    common/paletteremap.cpp \
+    common/contenthash.cpp \
+    common/quantizer.cpp \
+    common/deflater.cpp \
+    common/file.cpp \
+    common/fileview.cpp \
+    common/casefoldeddir.cpp \
+    common/outputtree.cpp \
+    common/threadpool.cpp \
+    common/trash.cpp \
     common/os.cpp \
     mapdump/main.cpp \
     common/util.cpp
 
 HEADERS += \
     common/bitmap.h \
+    common/imagestream.h \
+    common/bufferpool.h \
+    common/rgbabitmap.h \
+    common/imageutil.h \
+    common/paletteremap.h \
+    common/contenthash.h \
+    common/quantizer.h \
+    common/deflater.h \
+    common/file.h \
+    common/fileview.h \
+    common/casefoldeddir.h \
+    common/outputtree.h \
+    common/threadpool.h \
+    common/trash.h \
     common/os.h \
     common/util.h
 
@@ -2,6 +2,13 @@
 #include <iomanip>
 #include <stdexcept>
 #include <algorithm>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+#include <cstdlib>
 
 #include <data.h>
 #include <reader_lcf.h>
@@ -11,9 +18,27 @@
 
 #include "os.h"
 #include "bitmap.h"
+#include "rgbabitmap.h"
 #include "util.h"
+#include "outputtree.h"
+#include "casefoldeddir.h"
+#include "threadpool.h"
+#include "contenthash.h"
 
 #define OUT_DIR_NAME "DUMP"
+#define MANIFEST_NAME "manifest.txt"
+//Bump whenever the same inputs would render differently
+#define RENDERER_VERSION 1
+#define ATLAS_COLUMNS 64
+#define ATLAS_TILES (3000 + 3 + 1000 + 144 + 144)
+
+//What dumpMap writes
+enum Layer {
+    LayerLower = 1,
+    LayerUpper = 2,
+    LayerComposite = 4,
+};
+static const char *const layerFiles[] = {"lower.png", "upper.png", "composite.png"};
 
 /*
  * Big shoutout to
@@ -150,8 +175,25 @@ std::string getMapPath(int id)
     return path;
 }
 
+//The dirs a map path puts files in, parents first, the way OutputTree makes
+//them: empty and "." names add no level
+std::vector<std::string> getMapDirs(const std::string &path)
+{
+    std::vector<std::string> dirs;
+    std::string dir;
+    for (size_t start = 0, pos = path.find(PATH_SEPARATOR); pos != std::string::npos; start = pos + 1, pos = path.find(PATH_SEPARATOR, start)) {
+        std::string name = path.substr(start, pos - start);
+        if (name.empty() || name == ".")
+            continue;
+        dir += name + PATH_SEPARATOR;
+        dirs.push_back(dir);
+    }
+    return dirs;
+}
+
 void drawTile(Bitmap &dst, const Bitmap &src, int dX, int dY, int tile)
 {
+    //Every cell is drawn once onto a blank layer, so there is nothing to mask against
     if (tile >= 10000 && tile < 10000 + 24 * 6) {
         //Upper layer
         tile -= 10000;
@@ -163,7 +205,7 @@ void drawTile(Bitmap &dst, const Bitmap &src, int dX, int dY, int tile)
             y -= 8;
             x += 6;
         }
-        dst.blit(dX * 16, dY * 16, src, x * 16, y * 16, 16, 16);
+        dst.blit(dX * 16, dY * 16, src, x * 16, y * 16, 16, 16, Bitmap::Opaque);
     } else if (tile >= 5000 && tile < 5000 + 24 * 6) {
         //Normal lower layer
         tile -= 5000;
@@ -173,16 +215,16 @@ void drawTile(Bitmap &dst, const Bitmap &src, int dX, int dY, int tile)
             y -= 16;
             x += 6;
         }
-        dst.blit(dX * 16, dY * 16, src, x * 16, y * 16, 16, 16);
+        dst.blit(dX * 16, dY * 16, src, x * 16, y * 16, 16, 16, Bitmap::Opaque);
     } else if (tile >= 3000 && tile < 3050) {
         //Animated single water tile A
-        dst.blit(dX * 16, dY * 16, src, 3 * 16, 4 * 16, 16, 16);
+        dst.blit(dX * 16, dY * 16, src, 3 * 16, 4 * 16, 16, 16, Bitmap::Opaque);
     } else if (tile >= 3050 && tile < 3100) {
         //Animated single water tile B
-        dst.blit(dX * 16, dY * 16, src, 4 * 16, 4 * 16, 16, 16);
+        dst.blit(dX * 16, dY * 16, src, 4 * 16, 4 * 16, 16, 16, Bitmap::Opaque);
     } else if (tile >= 3100 && tile < 3150) {
         //Animated single water tile C
-        dst.blit(dX * 16, dY * 16, src, 5 * 16, 4 * 16, 16, 16);
+        dst.blit(dX * 16, dY * 16, src, 5 * 16, 4 * 16, 16, 16, Bitmap::Opaque);
     } else if (tile >= 4000 && tile < 5000) {
         //Normal autotile
         int block = (tile - 4000) / 50;
@@ -206,7 +248,7 @@ void drawTile(Bitmap &dst, const Bitmap &src, int dX, int dY, int tile)
                 // Get the block D subtiles ids and get their coordinates on the chipset
                 int x = (block_x + normalAutotileIds[subtile][j][i][0]) * 16 + i * 8;
                 int y = (block_y + normalAutotileIds[subtile][j][i][1]) * 16 + j * 8;
-                dst.blit(dX * 16 + i * 8, dY * 16 + j * 8, src, x, y, 8, 8);
+                dst.blit(dX * 16 + i * 8, dY * 16 + j * 8, src, x, y, 8, 8, Bitmap::Opaque);
             }
         }
     } else if (tile < 3000) {
@@ -267,57 +309,398 @@ void drawTile(Bitmap &dst, const Bitmap &src, int dX, int dY, int tile)
             for (int i = 0; i < 2; i++) {
                 int x = quarters[j][i][0] * 16 + i * 8;
                 int y = quarters[j][i][1] * 16 + j * 8;
-                dst.blit(dX * 16 + i * 8, dY * 16 + j * 8, src, x, y, 8, 8);
+                dst.blit(dX * 16 + i * 8, dY * 16 + j * 8, src, x, y, 8, 8, Bitmap::Opaque);
             }
         }
     }
 }
 
-void dumpMap(const std::string &gamePath, const std::string &mapPath, const std::string &encoding, int id, const std::vector<Bitmap> &chipsets)
+//Every tile a chipset can draw, composed by drawTile into its own 16x16 cell
+//of one big bitmap, so maps just copy cells. Cells are composed a row of the
+//atlas at a time, the first time a tile in that row is needed, and are then
+//shared by every map using the chipset, from any thread.
+class TileAtlas
 {
-    //Make output dir
-    std::string outPath = gamePath + OUT_DIR_NAME PATH_SEPARATOR + mapPath;
-    Util::mkdir(outPath);
+public:
+    /* constructors and destructors */
+    explicit TileAtlas(const Bitmap &chipset) :
+        chipset(chipset),
+        tiles(ATLAS_COLUMNS * 16, (ATLAS_TILES + ATLAS_COLUMNS - 1) / ATLAS_COLUMNS * 16),
+        composed(new std::once_flag[(ATLAS_TILES + ATLAS_COLUMNS - 1) / ATLAS_COLUMNS])
+    {
+    }
 
-    //Load map
+    //Accessors
+    const Bitmap &getChipset() const { return chipset; }
+
+    //Copies tile to cell (dX, dY) of dst; tiles that draw nothing are skipped
+    void draw(Bitmap &dst, int dX, int dY, int tile, Bitmap::BlitMode mode = Bitmap::Opaque)
+    {
+        int cell = cellOf(tile);
+        if (cell < 0)
+            return;
+        int row = cell / ATLAS_COLUMNS;
+        std::call_once(composed[row], [&]() { compose(row); });
+        dst.blit(dX * 16, dY * 16, tiles, cell % ATLAS_COLUMNS * 16, row * 16, 16, 16, mode);
+    }
+
+private:
+    TileAtlas(const TileAtlas &);
+    TileAtlas &operator=(const TileAtlas &);
+
+    //Where a tile lives in the atlas, or -1. The three single water tiles
+    //each span 50 IDs; water tiles with no subtile pattern (a_subtile past
+    //the 47 in waterAutotileIds) are not drawn.
+    static int cellOf(int tile)
+    {
+        if (tile >= 0 && tile < 3000)
+            return tile % 50 < 47 ? tile : -1;
+        if (tile >= 3000 && tile < 3150)
+            return 3000 + (tile - 3000) / 50;
+        if (tile >= 4000 && tile < 5000)
+            return 3003 + tile - 4000;
+        if (tile >= 5000 && tile < 5000 + 24 * 6)
+            return 4003 + tile - 5000;
+        if (tile >= 10000 && tile < 10000 + 24 * 6)
+            return 4147 + tile - 10000;
+        return -1;
+    }
+
+    static int tileOf(int cell)
+    {
+        if (cell < 3000)
+            return cell;
+        if (cell < 3003)
+            return 3000 + (cell - 3000) * 50;
+        if (cell < 4003)
+            return 4000 + cell - 3003;
+        if (cell < 4147)
+            return 5000 + cell - 4003;
+        return 10000 + cell - 4147;
+    }
+
+    void compose(int row)
+    {
+        for (int i = 0; i < ATLAS_COLUMNS; ++i) {
+            int cell = row * ATLAS_COLUMNS + i;
+            if (cell < ATLAS_TILES && cellOf(tileOf(cell)) == cell)
+                drawTile(tiles, chipset, i, row, tileOf(cell));
+        }
+    }
+
+    const Bitmap &chipset;
+    Bitmap tiles;
+    std::unique_ptr<std::once_flag[]> composed; //per atlas row
+};
+
+//Chipsets by ID, each decoded (and given its TileAtlas) the first time a map
+//asks for it, from whichever thread that happens on; chipsets no map uses are
+//never loaded. Files are found up front, which only takes a directory lookup.
+class ChipsetCache
+{
+public:
+    /* constructors and destructors */
+    ChipsetCache(const std::string &chipsetPath, const CaseFoldedDir &chipsetFiles) :
+        count(Data::chipsets.size()),
+        entries(new Entry[count])
+    {
+        static const char *const exts[] = {
+            ".xyz", ".png", ".bmp"
+        };
+
+        for (unsigned int i = 0; i < count; ++i) {
+            if (Data::chipsets[i].chipset_name.empty())
+                continue;
+
+            unsigned int j = 0;
+            for (; j < ARRAY_SIZE(exts); ++j) {
+                const Util::DirEntry *entry = chipsetFiles.find(Data::chipsets[i].chipset_name + exts[j],
+                                                                Util::DirEntry::File);
+                if (entry != NULL) {
+                    entries[i].filename = chipsetPath + entry->name;
+                    break;
+                }
+            }
+            if (j == ARRAY_SIZE(exts)) {
+                std::cerr << "warning: " << Data::chipsets[i].chipset_name << ": could not find file" << std::endl;
+            }
+        }
+    }
+
+    //The tiles of chipset id, loading it if need be; NULL if it has no image
+    TileAtlas *get(int id)
+    {
+        Entry *entry = find(id);
+        if (entry == NULL)
+            return NULL;
+        std::call_once(entry->loaded, [entry]() {
+            entry->bitmap = Bitmap(entry->filename);
+            if (!entry->bitmap.empty())
+                entry->atlas.reset(new TileAtlas(entry->bitmap));
+        });
+        return entry->atlas.get();
+    }
+
+    //Hash of the file of chipset id, without decoding it; 0 if there is none
+    uint64_t getHash(int id)
+    {
+        Entry *entry = find(id);
+        if (entry == NULL)
+            return 0;
+        std::call_once(entry->hashed, [entry]() { entry->hash = hashFile(entry->filename); });
+        return entry->hash;
+    }
+
+private:
+    ChipsetCache(const ChipsetCache &);
+    ChipsetCache &operator=(const ChipsetCache &);
+
+    struct Entry
+    {
+        std::string filename; //empty if not found
+        std::once_flag loaded;
+        Bitmap bitmap;
+        std::unique_ptr<TileAtlas> atlas;
+        std::once_flag hashed;
+        uint64_t hash;
+    };
+
+    Entry *find(int id)
+    {
+        if (id <= 0 || static_cast<unsigned int>(id) > count || entries[id - 1].filename.empty())
+            return NULL;
+        return &entries[id - 1];
+    }
+
+    unsigned int count;
+    std::unique_ptr<Entry[]> entries;
+};
+
+std::string getLmuPath(const std::string &gamePath, int id)
+{
     std::ostringstream ss;
     ss << gamePath << "Map" << std::setw(4) << std::setfill('0') << id << ".lmu";
-    std::auto_ptr<RPG::Map> map = LMU_Reader::Load(unicodeCompatPath(ss.str()), encoding);
+    return ss.str();
+}
+
+std::auto_ptr<RPG::Map> loadMap(const std::string &gamePath, const std::string &encoding, int id)
+{
+    //liblcf is not made for concurrent use (its last error alone is global),
+    //so maps are parsed one at a time; rendering them is what takes long
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string lmuPath = getLmuPath(gamePath, id);
+    std::auto_ptr<RPG::Map> map = LMU_Reader::Load(unicodeCompatPath(lmuPath), encoding);
     if (map.get() == NULL)
-        throw std::runtime_error("could not load map file \"" + ss.str() + "\": " + LcfReader::GetError());
-
-    if (map->chipset_id > 0) {
-        //Get chipset reference
-        const Bitmap &chipset = chipsets[map->chipset_id - 1];
-
-        //Blit to bitmap
-        if (!chipset.empty()) {
-            //Create output image objects
-            Bitmap lowerLayer(map->width * 16, map->height * 16);
-            Bitmap upperLayer(map->width * 16, map->height * 16);
-
-            for (int y = 0; y < map->height; ++y) {
-                for (int x = 0; x < map->width; ++x) {
-                    drawTile(lowerLayer, chipset, x, y, map->lower_layer[y * map->width + x]);
-                    drawTile(upperLayer, chipset, x, y, map->upper_layer[y * map->width + x]);
-                }
+        throw std::runtime_error("could not load map file \"" + lmuPath + "\": " + LcfReader::GetError());
+    return map;
+}
+
+//What a map was rendered from. Its LMU names the chipset, so as long as the
+//LMU hash matches, so does the chipset ID.
+struct ManifestEntry
+{
+    uint64_t lmuHash;
+    int chipsetId;
+    uint64_t chipsetHash;
+    std::string outPath;
+};
+
+//The first line of the manifest: everything besides the inputs of each map
+//that the output depends on
+std::string manifestHeader(unsigned int layers, bool rgba, unsigned int scale)
+{
+    std::ostringstream ss;
+    ss << "mapdump " << RENDERER_VERSION << " layers=" << layers << " rgba=" << rgba << " scale=" << scale;
+    return ss.str();
+}
+
+//Entries by map ID; none if there is no manifest yet
+std::map<int, ManifestEntry> readManifest(const std::string &filename, std::string &header)
+{
+    std::map<int, ManifestEntry> entries;
+    header.clear();
+    std::string contents;
+    try {
+        contents = Util::readFileContents(filename);
+    } catch (std::runtime_error &e) {
+        return entries;
+    }
+
+    //Lines of "id lmuHash chipsetId chipsetHash outPath"; the path goes last
+    //as it may contain spaces
+    std::istringstream in(contents);
+    std::getline(in, header);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        int id;
+        std::string lmuHash, chipsetHash;
+        ManifestEntry entry;
+        if (!(fields >> id >> lmuHash >> entry.chipsetId >> chipsetHash))
+            continue;
+        entry.lmuHash = strtoull(lmuHash.c_str(), NULL, 16);
+        entry.chipsetHash = strtoull(chipsetHash.c_str(), NULL, 16);
+        std::getline(fields.ignore(1), entry.outPath);
+        entries[id] = entry;
+    }
+    return entries;
+}
+
+void writeManifest(OutputTree &tree, const std::string &header, const std::map<int, ManifestEntry> &entries)
+{
+    std::ostringstream out;
+    out << header << '\n';
+    for (std::map<int, ManifestEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        out << it->first << ' ' << ContentHash::toString(it->second.lmuHash) << ' ' << it->second.chipsetId << ' '
+            << ContentHash::toString(it->second.chipsetHash) << ' ' << it->second.outPath << '\n';
+    }
+
+    std::string contents = out.str();
+    FILE *file = tree.create(MANIFEST_NAME);
+    bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    if (fclose(file) != 0 || !written)
+        throw std::runtime_error(tree.getRoot() + MANIFEST_NAME ": could not write file");
+}
+
+//Shared by every map; runs the PNG encodes of one map side by side
+static ThreadPool &encodePool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+//Returns the chipset ID of the map
+int dumpMap(const std::string &gamePath, OutputTree &tree, const std::string &outPath, const std::string &encoding, int id,
+            ChipsetCache &chipsets, unsigned int layers, bool rgba, unsigned int scale)
+{
+    //Load map
+    std::auto_ptr<RPG::Map> map = loadMap(gamePath, encoding, id);
+
+    //Get the chipset's tiles
+    TileAtlas *atlas = chipsets.get(map->chipset_id);
+    if (atlas == NULL)
+        return map->chipset_id;
+    const std::vector<uint8_t> &palette = atlas->getChipset().getPalette();
+
+    //Create output image objects, only for the layers asked for
+    Bitmap outputs[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+        if (layers & (1 << i))
+            outputs[i] = Bitmap(map->width * 16, map->height * 16);
+    }
+    Bitmap &lowerLayer = outputs[0];
+    Bitmap &upperLayer = outputs[1];
+    Bitmap &composite = outputs[2];
+
+    //One pass over the cells draws every layer; the composite is the lower
+    //tile with the upper one over it
+    for (int y = 0; y < map->height; ++y) {
+        for (int x = 0; x < map->width; ++x) {
+            int lower = map->lower_layer[y * map->width + x];
+            int upper = map->upper_layer[y * map->width + x];
+            if (layers & LayerLower)
+                atlas->draw(lowerLayer, x, y, lower);
+            if (layers & LayerUpper)
+                atlas->draw(upperLayer, x, y, upper);
+            if (layers & LayerComposite) {
+                atlas->draw(composite, x, y, lower);
+                atlas->draw(composite, x, y, upper, Bitmap::Transparent);
             }
+        }
+    }
 
-            //Save to file
-            lowerLayer.writeToPng(outPath + "lower.png", true, chipset.getPalette());
-            upperLayer.writeToPng(outPath + "upper.png", true, chipset.getPalette());
+    //Encode the layers concurrently
+    std::vector<std::shared_ptr<std::packaged_task<void()> > > encodes;
+    for (unsigned int i = 0; i < 3; ++i) {
+        if (!(layers & (1 << i)))
+            continue;
+        const Bitmap &layer = outputs[i];
+        std::string filename = outPath + layerFiles[i];
+        std::shared_ptr<std::packaged_task<void()> > task(new std::packaged_task<void()>([&, filename]() {
+            if (rgba) {
+                //Truecolor, with the blank parts of each layer as real alpha
+                RgbaBitmap(layer, palette, true).writeToPng(tree, filename, scale);
+            } else {
+                layer.writeToPng(tree, filename, true, palette, scale);
+            }
+        }));
+        encodes.push_back(task);
+        encodePool().run([task]() { (*task)(); });
+    }
 
-            //Create composite image
-            lowerLayer.blit(0, 0, upperLayer, 0, 0, upperLayer.getWidth(), upperLayer.getHeight());
-            lowerLayer.writeToPng(outPath + "composite.png", true, chipset.getPalette());
+    //Every encode uses the layers, so all of them finish before any error
+    //gets out of here
+    std::exception_ptr error;
+    for (unsigned int i = 0; i < encodes.size(); ++i) {
+        try {
+            encodes[i]->get_future().get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
         }
     }
+    if (error)
+        std::rethrow_exception(error);
+    return map->chipset_id;
 }
 
-int unimain(const std::vector<std::string> &args)
+//Layer flags from a list like "lower,composite"; 0 if anything is off
+unsigned int parseLayers(const std::string &list)
 {
+    static const char *const names[] = {"lower", "upper", "composite"};
+    unsigned int layers = 0;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string name = list.substr(start, end - start);
+        unsigned int i = 0;
+        while (i < ARRAY_SIZE(names) && name != names[i])
+            ++i;
+        if (i == ARRAY_SIZE(names))
+            return 0;
+        layers |= 1 << i;
+        start = end + 1;
+    }
+    return layers;
+}
+
+int unimain(const std::vector<std::string> &argv)
+{
+    //Split off flags
+    bool rgba = false;
+    unsigned int scale = 1;
+    int jobs = 0;
+    unsigned int layers = LayerLower | LayerUpper | LayerComposite;
+    std::vector<std::string> args;
+    for (unsigned int i = 0; i < argv.size(); ++i) {
+        if (argv[i] == "--rgba")
+            rgba = true;
+        else if (argv[i] == "--scale" && i + 1 < argv.size())
+            scale = atoi(argv[++i].c_str());
+        else if (argv[i] == "--jobs" && i + 1 < argv.size())
+            jobs = atoi(argv[++i].c_str());
+        else if (argv[i] == "--layers" && i + 1 < argv.size())
+            layers = parseLayers(argv[++i]);
+        else
+            args.push_back(argv[i]);
+    }
+
     if (args.size() < 1) {
-        std::cerr << "usage: mapdump game_path [encoding]" << std::endl;
+        std::cerr << "usage: mapdump [--rgba] [--scale N] [--jobs N] [--layers lower,upper,composite] game_path [encoding]" << std::endl;
+        return 1;
+    }
+    if (scale < 1 || scale > BITMAP_MAX_SCALE) {
+        std::cerr << "error: --scale must be between 1 and " << BITMAP_MAX_SCALE << std::endl;
+        return 1;
+    }
+    if (layers == 0) {
+        std::cerr << "error: --layers takes a comma-separated list of lower, upper and composite" << std::endl;
+        return 1;
+    }
+    if (jobs < 0) {
+        std::cerr << "error: --jobs must be at least 1 (or 0 for every core)" << std::endl;
         return 1;
     }
 
@@ -331,25 +714,17 @@ int unimain(const std::vector<std::string> &args)
         std::string ldbPath = gamePath + "RPG_RT.ldb";
         std::string chipsetPath = gamePath + "ChipSet" PATH_SEPARATOR;
 #elif defined OS_UNIX
-        std::string lmtPath, ldbPath, chipsetPath;
-        {
-            std::vector<std::string> files = Util::listFiles(gamePath);
-            for (unsigned int i = 0; i < files.size(); ++i) {
-                std::string lower = Util::toLower(files[i]);
-                if (lower == "rpg_rt.lmt")
-                    lmtPath = gamePath + files[i];
-                else if (lower == "rpg_rt.ldb")
-                    ldbPath = gamePath + files[i];
-                else if (lower == "chipset")
-                    chipsetPath = gamePath + files[i] + PATH_SEPARATOR;
-                if (!lmtPath.empty() && !ldbPath.empty() && !chipsetPath.empty())
-                    break;
-            }
-        }
-        if (lmtPath.empty() || ldbPath.empty() || chipsetPath.empty()) {
+        const CaseFoldedDir &gameDir = CaseFoldedDir::get(gamePath);
+        const Util::DirEntry *lmt = gameDir.find("RPG_RT.lmt");
+        const Util::DirEntry *ldb = gameDir.find("RPG_RT.ldb");
+        const Util::DirEntry *chipsetDir = gameDir.find("ChipSet", Util::DirEntry::Directory);
+        if (lmt == NULL || ldb == NULL || chipsetDir == NULL) {
             std::cerr << "error: could not find RPG_RT.lmt, RPG_RT.ldb, and ChipSet" << std::endl;
             return 1;
         }
+        std::string lmtPath = gamePath + lmt->name;
+        std::string ldbPath = gamePath + ldb->name;
+        std::string chipsetPath = gamePath + chipsetDir->name + PATH_SEPARATOR;
 #endif
 
         //Get encoding; try to detect if none specified
@@ -375,46 +750,158 @@ int unimain(const std::vector<std::string> &args)
             return 1;
         }
 
-        //List files in chipsetPath, cache lowercase
-        std::vector<std::string> chipsetFilenames = Util::listFiles(chipsetPath);
-        std::vector<std::string> chipsetFilenamesLower;
-        chipsetFilenamesLower.reserve(chipsetFilenames.size());
-        for (unsigned int i = 0; i < chipsetFilenames.size(); ++i)
-            chipsetFilenamesLower.push_back(Util::toLower(chipsetFilenames[i]));
-
-        //Load chipset bitmaps
-        std::vector<Bitmap> chipsets;
-        chipsets.resize(Data::chipsets.size());
-        for (unsigned int i = 0; i < chipsets.size(); ++i) {
-            if (Data::chipsets[i].chipset_name.empty())
-                continue;
+        const CaseFoldedDir &chipsetFiles = CaseFoldedDir::get(chipsetPath);
 
-            static const char *const exts[] = {
-                ".xyz", ".png", ".bmp"
-            };
+        //Chipsets are only loaded once a map needs them
+        ChipsetCache chipsets(chipsetPath, chipsetFiles);
 
-            unsigned int j = 0;
-            for (; j < ARRAY_SIZE(exts); ++j) {
-                std::string lowername = Util::toLower(Data::chipsets[i].chipset_name) + exts[j];
-                std::vector<std::string>::iterator index = std::find(chipsetFilenamesLower.begin(),
-                                                                     chipsetFilenamesLower.end(),
-                                                                     lowername);
-                if (index != chipsetFilenamesLower.end()) {
-                    chipsets[i] = Bitmap(chipsetPath + chipsetFilenames[index - chipsetFilenamesLower.begin()]);
-                    break;
+        //Make every output dir first, in tree order, so parents always come
+        //before their children. Maps that end up in the same dir (siblings
+        //with the same name) stay together and in order, so the last one
+        //still wins.
+        OutputTree tree(gamePath + OUT_DIR_NAME PATH_SEPARATOR);
+        std::vector<std::string> outPaths;
+        std::map<std::string, std::vector<int> > mapsByPath;
+        for (unsigned int i = 1; i < Data::treemap.tree_order.size(); ++i) {
+            int id = Data::treemap.tree_order[i];
+            std::string outPath = getMapPath(id);
+            std::vector<int> &ids = mapsByPath[outPath];
+            if (ids.empty()) {
+                tree.mkdirs(outPath);
+                outPaths.push_back(outPath);
+            }
+            ids.push_back(id);
+        }
+
+        //Compare with the manifest of the last run. A dir is rendered again
+        //unless every map in it has the same LMU, chipset ID and chipset
+        //file as then, no other map used to be rendered there too, and its
+        //layer files are all still there.
+        std::string header = manifestHeader(layers, rgba, scale);
+        std::string previousHeader;
+        std::map<int, ManifestEntry> previous = readManifest(tree.getRoot() + MANIFEST_NAME, previousHeader);
+        std::map<int, ManifestEntry> current;
+        std::map<std::string, unsigned int> previousMapsByPath;
+        for (std::map<int, ManifestEntry>::iterator it = previous.begin(); it != previous.end(); ++it)
+            ++previousMapsByPath[it->second.outPath];
+        std::vector<char> done(outPaths.size());
+        for (unsigned int i = 0; i < outPaths.size(); ++i) {
+            const std::vector<int> &ids = mapsByPath[outPaths[i]];
+            bool unchanged = header == previousHeader && previousMapsByPath[outPaths[i]] == ids.size();
+            for (unsigned int j = 0; j < ids.size(); ++j) {
+                ManifestEntry &entry = current[ids[j]];
+                entry.outPath = outPaths[i];
+                entry.chipsetId = 0;
+                entry.chipsetHash = 0;
+                try {
+                    entry.lmuHash = hashFile(getLmuPath(gamePath, ids[j]));
+                } catch (std::runtime_error &e) {
+                    //Rendering it reports the error
+                    entry.lmuHash = 0;
+                    unchanged = false;
+                }
+
+                std::map<int, ManifestEntry>::iterator old = previous.find(ids[j]);
+                if (old == previous.end() || old->second.lmuHash != entry.lmuHash || old->second.outPath != entry.outPath) {
+                    unchanged = false;
+                    continue;
                 }
+                entry.chipsetId = old->second.chipsetId;
+                entry.chipsetHash = chipsets.getHash(entry.chipsetId);
+                unchanged = unchanged && entry.chipsetHash == old->second.chipsetHash;
             }
-            if (j == ARRAY_SIZE(exts)) {
-                std::cerr << "warning: " << Data::chipsets[i].chipset_name << ": could not find file" << std::endl;
+
+            //The manifest only says what was written, not what is left
+            for (unsigned int j = 0; j < ARRAY_SIZE(layerFiles) && unchanged; ++j) {
+                if (layers & (1 << j))
+                    unchanged = Util::fileExists(tree.getRoot() + outPaths[i] + layerFiles[j]);
             }
+            done[i] = unchanged;
         }
 
-        //For each map...
-        Util::mkdir(gamePath + OUT_DIR_NAME);
-        for (unsigned int i = 1; i < Data::treemap.tree_order.size(); ++i) {
-            int id = Data::treemap.tree_order[i];
-            dumpMap(gamePath, getMapPath(id), encoding, id, chipsets);
+        //Delete what was rendered for maps that are gone (or moved), then
+        //the dirs that leaves empty. Dirs of current maps and their parents
+        //stay; a path sorts after its parents, so going backwards removes
+        //the deepest dirs first.
+        std::set<std::string> keptDirs, emptiedDirs;
+        for (unsigned int i = 0; i < outPaths.size(); ++i) {
+            std::vector<std::string> dirs = getMapDirs(outPaths[i]);
+            keptDirs.insert(dirs.begin(), dirs.end());
+        }
+        for (std::map<std::string, unsigned int>::iterator it = previousMapsByPath.begin(); it != previousMapsByPath.end(); ++it) {
+            if (mapsByPath.find(it->first) != mapsByPath.end())
+                continue;
+            for (unsigned int i = 0; i < ARRAY_SIZE(layerFiles); ++i)
+                Util::deleteFile(tree.getRoot() + it->first + layerFiles[i]);
+            std::vector<std::string> dirs = getMapDirs(it->first);
+            for (unsigned int i = 0; i < dirs.size(); ++i) {
+                if (keptDirs.find(dirs[i]) == keptDirs.end())
+                    emptiedDirs.insert(dirs[i]);
+            }
+        }
+        for (std::set<std::string>::reverse_iterator it = emptiedDirs.rbegin(); it != emptiedDirs.rend(); ++it)
+            Util::deleteEmptyFolder(tree.getRoot() + *it); //fails if anything else is in there
+
+        //Then render the maps in parallel; the pool hands each idle worker
+        //the next map, so a few huge maps do not hold up the rest. Each task
+        //only touches the entries of its own maps.
+        ThreadPool pool(jobs);
+
+        //Maps rendered again most likely use the same chipset as last time,
+        //so those are decoded side by side before any map gets to them
+        std::set<int> expected;
+        for (unsigned int i = 0; i < outPaths.size(); ++i) {
+            const std::vector<int> &ids = mapsByPath[outPaths[i]];
+            for (unsigned int j = 0; j < ids.size() && !done[i]; ++j) {
+                std::map<int, ManifestEntry>::iterator old = previous.find(ids[j]);
+                if (old != previous.end() && old->second.chipsetId > 0)
+                    expected.insert(old->second.chipsetId);
+            }
+        }
+        for (std::set<int>::iterator it = expected.begin(); it != expected.end(); ++it) {
+            int id = *it;
+            pool.run([&chipsets, id]() {
+                try {
+                    chipsets.get(id);
+                } catch (std::runtime_error &e) {
+                    //Maybe no map needs it anymore; if one does, it reports it
+                }
+            });
+        }
+        for (unsigned int i = 0; i < outPaths.size(); ++i) {
+            if (done[i])
+                continue;
+
+            //Start clean, in case the layers asked for or the chipset changed
+            for (unsigned int j = 0; j < ARRAY_SIZE(layerFiles); ++j)
+                Util::deleteFile(tree.getRoot() + outPaths[i] + layerFiles[j]);
+
+            pool.run([&, i]() {
+                const std::vector<int> &ids = mapsByPath.find(outPaths[i])->second;
+                for (unsigned int j = 0; j < ids.size(); ++j) {
+                    ManifestEntry &entry = current.find(ids[j])->second;
+                    entry.chipsetId = dumpMap(gamePath, tree, outPaths[i], encoding, ids[j], chipsets, layers, rgba, scale);
+                    entry.chipsetHash = chipsets.getHash(entry.chipsetId);
+                }
+                done[i] = true;
+            });
+        }
+
+        //Whatever got done is recorded, even if something failed
+        try {
+            pool.wait();
+        } catch (...) {
+            for (unsigned int i = 0; i < outPaths.size(); ++i) {
+                if (!done[i]) {
+                    const std::vector<int> &ids = mapsByPath[outPaths[i]];
+                    for (unsigned int j = 0; j < ids.size(); ++j)
+                        current.erase(ids[j]);
+                }
+            }
+            writeManifest(tree, header, current);
+            throw;
         }
+        writeManifest(tree, header, current);
     } catch (std::runtime_error &e) {
         std::cerr << "error: " << e.what() << std::endl;
         return 1;
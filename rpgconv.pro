@@ -1,10 +1,9 @@
 TEMPLATE = app
 CONFIG -= app_bundle qt
-CONFIG += console link_pkgconfig
+CONFIG += console link_pkgconfig c++11 thread
 
 PKGCONFIG += libpng zlib
 DEFINES += UCONV
-unix:PKGCONFIG += icu-uc
 
 INCLUDEPATH += common
 
@@ -15,12 +14,41 @@ SOURCES += rpgconv/main.cpp \
     rpgconv/rgssa1.cpp \
     rpgconv/rgssa3.cpp \
     rpgconv/rgssa.cpp \
-    common/bitmap.cpp
+    common/bitmap.cpp \
+    common/imagestream.cpp \
+    common/bufferpool.cpp \
+    common/rgbabitmap.cpp \
+    common/paletteremap.cpp \
+    common/contenthash.cpp \
+    common/quantizer.cpp \
+    common/deflater.cpp \
+    common/file.cpp \
+    common/fileview.cpp \
+    common/casefoldeddir.cpp \
+    common/outputtree.cpp \
+    common/threadpool.cpp \
+    common/trash.cpp
 
 HEADERS += \
     common/os.h \
     common/util.h \
+    common/cp932.h \
+    common/lowercase.h \
     rpgconv/rgssa.h \
-    common/bitmap.h
+    common/bitmap.h \
+    common/imagestream.h \
+    common/bufferpool.h \
+    common/rgbabitmap.h \
+    common/imageutil.h \
+    common/paletteremap.h \
+    common/contenthash.h \
+    common/quantizer.h \
+    common/deflater.h \
+    common/file.h \
+    common/fileview.h \
+    common/casefoldeddir.h \
+    common/outputtree.h \
+    common/threadpool.h \
+    common/trash.h
 
 win32:RC_ICONS += common/icon.ico
@@ -2,11 +2,18 @@
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <cstring>
 
 #include "rgssa.h"
 #include "os.h"
 #include "util.h"
 #include "bitmap.h"
+#include "imagestream.h"
+#include "file.h"
+#include "trash.h"
+#include "outputtree.h"
+#include "casefoldeddir.h"
+#include "contenthash.h"
 
 /* ARCHIVE NAMESPACES */
 namespace Wolf
@@ -26,19 +33,117 @@ void pack(const std::string &filename, const std::string &srcpath, const std::ve
 
 static inline void usage()
 {
-    std::cerr << "usage: rpgconv [game_or_project_dir]" << std::endl;
+    std::cerr << "usage: rpgconv [--wait] [--lossy] [game_or_project_dir [output_dir]]" << std::endl;
+    std::cerr << "       rpgconv --hash-assets [game_or_project_dir]" << std::endl;
 }
 
-int unimain(const std::vector<std::string> &args)
+//Whether file is named like an image to convert: XYZ (toProject) or PNG/BMP
+static bool is2kImageName(const std::string &file, bool toProject)
 {
+    std::string ext = Util::getExtension(file);
+    return toProject ? ext == "xyz" : ext == "png" || ext == "bmp";
+}
+
+//Converts XYZ to PNG (toProject) or PNG/BMP to XYZ. The extension picks the
+//files to convert; the contents must agree with it and pick the decoder.
+//Truecolor images that do not fit in 256 colors are only reduced if lossy.
+//Returns whether file was converted; the caller deletes it once the reader
+//has let go of it.
+static bool convert2kImage(const std::string &file, OutputTree &tree, const std::string &outname, bool toProject, bool lossy)
+{
+    if (!is2kImageName(file, toProject))
+        return false;
+
+    ImageReader image(file);
+    bool isXyz = image.getFormat() == ImageReader::Xyz;
+    if (image.getFormat() == ImageReader::Unknown || toProject != isXyz) {
+        std::cerr << "warning: " << file << ": contents do not match the extension; skipped" << std::endl;
+        return false;
+    }
+
+    if (isXyz) {
+        Bitmap::transcodeToPng(image, tree, outname + ".png", false);
+    } else if (image.isTruecolor()) {
+        //Quantized whole before anything is written, so a lossy one can be left alone
+        Bitmap quantized;
+        if (!quantized.read(image)) {
+            if (!lossy) {
+                std::cerr << "warning: " << file << ": more than 255 opaque colors; skipped (--lossy reduces it to 256 colors)" << std::endl;
+                return false;
+            }
+            std::cerr << "warning: " << file << ": more than 255 opaque colors; reduced to 256 colors" << std::endl;
+        }
+        quantized.writeToXyz(tree, outname + ".xyz");
+    } else {
+        Bitmap::transcodeToXyz(image, tree, outname + ".xyz");
+    }
+    return true;
+}
+
+//Prints the content hash of every image in the 2k/2k3 folders, so assets can
+//be compared whether they are stored as XYZ, PNG or BMP
+static void hash2kImages(const std::string &gamePath, const std::vector<std::string> &rpg2kFolders)
+{
+    std::vector<std::string> names, files;
+    for (unsigned int i = 0; i < rpg2kFolders.size(); ++i) {
+        std::vector<Util::DirEntry> entries = Util::listEntries(gamePath + rpg2kFolders[i]);
+        for (unsigned int j = 0; j < entries.size(); ++j) {
+            if (entries[j].type != Util::DirEntry::File)
+                continue;
+            names.push_back(rpg2kFolders[i] + entries[j].name);
+            files.push_back(gamePath + names.back());
+        }
+    }
+
+    std::vector<std::string> hashes, errors;
+    hashImageFiles(files, hashes, errors);
+    for (unsigned int i = 0; i < files.size(); ++i) {
+        if (hashes[i].empty())
+            std::cerr << "warning: " << errors[i] << std::endl;
+        else
+            std::cout << hashes[i] << "  " << names[i] << std::endl;
+    }
+}
+
+int unimain(const std::vector<std::string> &argv)
+{
+    //Split off flags
+    bool waitForCleanup = false;
+    bool hashAssets = false;
+    bool lossy = false;
+    std::vector<std::string> args;
+    for (unsigned int i = 0; i < argv.size(); ++i) {
+        if (argv[i] == "--wait")
+            waitForCleanup = true;
+        else if (argv[i] == "--hash-assets")
+            hashAssets = true;
+        else if (argv[i] == "--lossy")
+            lossy = true;
+        else
+            args.push_back(argv[i]);
+    }
+
     //Get game path
     std::string gamePath;
     if (args.size() == 0)
         gamePath = "." PATH_SEPARATOR;
     else
         gamePath = Util::sanitizeDirPath(args[0]);
+    if (hashAssets && args.size() >= 2) {
+        usage();
+        return 1;
+    }
 
     try {
+        //Stage a copy of the game and convert that, leaving the original alone
+        if (args.size() >= 2) {
+            std::string outPath = Util::sanitizeDirPath(args[1]);
+            if (Util::dirExists(outPath))
+                throw std::runtime_error(outPath + ": output directory already exists");
+            Util::copyTree(gamePath, outPath);
+            gamePath = outPath;
+        }
+
         //Collect a bunch of information about the game for later
         std::string projFile;
         std::string rgssaFile;
@@ -49,68 +154,76 @@ int unimain(const std::vector<std::string> &args)
         std::vector<std::string> rpg2kFolders;
         int rgssver = 0;
         bool ldbFound = false;
-        std::vector<std::string> gameFiles = Util::listFiles(gamePath);
+        const CaseFoldedDir &gameDir = CaseFoldedDir::get(gamePath);
+        const std::vector<Util::DirEntry> &gameFiles = gameDir.getEntries();
         for (unsigned int i = 0; i < gameFiles.size(); ++i) {
-            std::string file = Util::toLower(gameFiles[i]);
+            const std::string &file = gameDir.getFoldedName(i);
             std::string ext = Util::getExtension(file);
             if (file == "data.wolf") {
-                wolfFile = gameFiles[i];
+                wolfFile = gameFiles[i].name;
             } else if (ext == "rxproj") {
                 rgssver = 1;
-                projFile = gameFiles[i];
+                projFile = gameFiles[i].name;
             } else if (ext == "rvproj") {
                 rgssver = 2;
-                projFile = gameFiles[i];
+                projFile = gameFiles[i].name;
             } else if (ext == "rvproj2") {
                 rgssver = 3;
-                projFile = gameFiles[i];
+                projFile = gameFiles[i].name;
             } else if (ext == "rgssad") {
                 rgssver = 1;
-                rgssaFile = gameFiles[i];
+                rgssaFile = gameFiles[i].name;
             } else if (ext == "rgss2a") {
                 rgssver = 2;
-                rgssaFile = gameFiles[i];
+                rgssaFile = gameFiles[i].name;
             } else if (ext == "rgss3a") {
                 rgssver = 3;
-                rgssaFile = gameFiles[i];
+                rgssaFile = gameFiles[i].name;
             } else if (ext == "ini") {
-                iniFile = gameFiles[i];
+                iniFile = gameFiles[i].name;
             } else if (ext == "ldb") {
                 ldbFound = true;
-            } else if (Util::dirExists(gamePath + gameFiles[i])) {
-                if (file == "data") {
-                    dataFolder = gameFiles[i];
-                } else if (file == "graphics") {
-                    graphicsFolder = gameFiles[i];
-                } else {
-                    static const char *const rpg2kFoldersMaster[] = {
-                        "backdrop",
-                        "battle",
-                        "battle2",
-                        "battlecharset",
-                        "battleweapon",
-                        "charset",
-                        "chipset",
-                        "faceset",
-                        "frame",
-                        "gameover",
-                        "monster",
-                        "panorama",
-                        "picture",
-                        "system",
-                        "system2",
-                        "title",
-                    };
-                    //Check if this is a 2k/2k3 folder; add to vector
-                    for (unsigned int j = 0; j < ARRAY_SIZE(rpg2kFoldersMaster); ++j) {
-                        if (file == rpg2kFoldersMaster[j]) {
-                            rpg2kFolders.push_back(gameFiles[i] + PATH_SEPARATOR);
-                            break;
-                        }
-                    }
-                }
             }
         }
+        const Util::DirEntry *entry = gameDir.find("data", Util::DirEntry::Directory);
+        if (entry != NULL)
+            dataFolder = entry->name;
+        entry = gameDir.find("graphics", Util::DirEntry::Directory);
+        if (entry != NULL)
+            graphicsFolder = entry->name;
+
+        //Find the 2k/2k3 folders
+        static const char *const rpg2kFoldersMaster[] = {
+            "backdrop",
+            "battle",
+            "battle2",
+            "battlecharset",
+            "battleweapon",
+            "charset",
+            "chipset",
+            "faceset",
+            "frame",
+            "gameover",
+            "monster",
+            "panorama",
+            "picture",
+            "system",
+            "system2",
+            "title",
+        };
+        for (unsigned int i = 0; i < ARRAY_SIZE(rpg2kFoldersMaster); ++i) {
+            entry = gameDir.find(rpg2kFoldersMaster[i], Util::DirEntry::Directory);
+            if (entry != NULL)
+                rpg2kFolders.push_back(entry->name + PATH_SEPARATOR);
+        }
+
+        //Only looking, not converting
+        if (hashAssets) {
+            if (!ldbFound)
+                throw std::runtime_error(gamePath + ": not an RPG Maker 2000/2003 game; no assets to hash");
+            hash2kImages(gamePath, rpg2kFolders);
+            return 0;
+        }
 
         //If we don't know our rgss version, determine via ini
         if (rgssver == 0 && !iniFile.empty()) {
@@ -130,6 +243,8 @@ int unimain(const std::vector<std::string> &args)
         //Determine if we should be converting to or from "edit" or "release"
         //IF: any (INDEXED) PNG or BMP: TO RELEASE
         //IF: no PNG or BMP: TO EDIT
+        //Truecolor PNGs do not decide it, as RPG Maker loads them on neither
+        //side; they are only converted along when going to release
         //IF: Data AND !Data.wolf: TO RELEASE (not implemented)
         //IF: Data.wolf AND !Data: TO EDIT
         //IF: Data.wolf AND Data: ERROR
@@ -141,12 +256,18 @@ int unimain(const std::vector<std::string> &args)
             convertToProject = true;
             for (unsigned int i = 0; i < rpg2kFolders.size(); ++i) {
                 std::string path = gamePath + rpg2kFolders[i];
-                std::vector<std::string> files = Util::listFiles(path);
+                std::vector<Util::DirEntry> files = Util::listEntries(path);
                 for (unsigned int j = 0; j < files.size(); ++j) {
-                    std::string ext = Util::getExtension(files[j]);
-                    if ((ext == "png" || ext == "bmp") && Bitmap::isIndexed(path + files[j])) {
-                        convertToProject = false;
-                        break;
+                    if (files[j].type != Util::DirEntry::File || !is2kImageName(files[j].name, false))
+                        continue;
+                    try {
+                        ImageReader image(path + files[j].name);
+                        if (image.getFormat() != ImageReader::Xyz && image.isIndexed()) {
+                            convertToProject = false;
+                            break;
+                        }
+                    } catch (std::runtime_error &e) {
+                        //Not for deciding; the conversion reports it
                     }
                 }
                 if (!convertToProject)
@@ -177,27 +298,23 @@ int unimain(const std::vector<std::string> &args)
                 convertToProject = projFile.empty();
         }
 
+        //Whatever gets deleted is removed in the background unless asked to wait
+        Trash trash(gamePath);
+
         //Do the conversion
         if (ldbFound) { //RPG Maker 2000/2003
+            OutputTree tree(gamePath);
             for (unsigned int i = 0; i < rpg2kFolders.size(); ++i) {
                 std::string path = gamePath + rpg2kFolders[i];
-                std::vector<std::string> files = Util::listFiles(path);
+                std::vector<Util::DirEntry> files = Util::listEntries(path);
                 for (unsigned int j = 0; j < files.size(); ++j) {
-                    std::string file = path + files[j];
-                    std::string outname = Util::getWithoutExtension(file);
-                    std::string ext = Util::getExtension(files[j]);
+                    if (files[j].type != Util::DirEntry::File)
+                        continue;
+                    std::string file = path + files[j].name;
+                    std::string outname = rpg2kFolders[i] + Util::getWithoutExtension(files[j].name);
                     try {
-                        if (convertToProject) {
-                            if (ext == "xyz") {
-                                Bitmap bitmap(file);
-                                bitmap.writeToPng(outname + ".png", false);
-                                Util::deleteFile(file);
-                            }
-                        } else if (ext == "png" || ext == "bmp") {
-                            Bitmap bitmap(file);
-                            bitmap.writeToXyz(outname + ".xyz");
+                        if (convert2kImage(file, tree, outname, convertToProject, lossy))
                             Util::deleteFile(file);
-                        }
                     } catch (std::runtime_error &e) {
                         std::cerr << "warning: " << e.what() << std::endl;
                     }
@@ -207,7 +324,7 @@ int unimain(const std::vector<std::string> &args)
             if (convertToProject) {
                 //Unpack archive, delete, done
                 Wolf::unpack(gamePath + wolfFile, gamePath);
-                Util::deleteFile(gamePath + wolfFile);
+                trash.add(gamePath + wolfFile);
             } else {
                 std::cerr << "error: cannot yet build release version of Wolf RPG Editor games" << std::endl;
                 return 1;
@@ -218,7 +335,7 @@ int unimain(const std::vector<std::string> &args)
                 Rgssa::unpack(gamePath + rgssaFile, gamePath);
 
                 //Delete archive
-                Util::deleteFile(gamePath + rgssaFile);
+                trash.add(gamePath + rgssaFile);
 
                 //Create project file
                 const char *const projexts[] = {".rxproj", ".rvproj", ".rvproj2"};
@@ -227,8 +344,9 @@ int unimain(const std::vector<std::string> &args)
                     "RPGVX 1.00", //"RPGVX 1.02",
                     "RPGVXAce 1.00", //"RPGVXAce 1.02",
                 };
-                ofstream projfile((gamePath + Util::getWithoutExtension(rgssaFile) + projexts[rgssver - 1]).c_str());
-                projfile << projdata[rgssver - 1];
+                File projfile(gamePath + Util::getWithoutExtension(rgssaFile) + projexts[rgssver - 1], File::Write);
+                projfile.write(projdata[rgssver - 1], std::strlen(projdata[rgssver - 1]));
+                projfile.close();
             } else {
                 //Get list of files to archive
                 std::vector<Rgssa::File> files;
@@ -255,11 +373,16 @@ int unimain(const std::vector<std::string> &args)
                 if (!projFile.empty())
                     Util::deleteFile(gamePath + projFile);
                 if (!dataFolder.empty())
-                    Util::deleteFolder(gamePath + dataFolder);
+                    trash.add(gamePath + dataFolder);
                 if (!graphicsFolder.empty())
-                    Util::deleteFolder(gamePath + graphicsFolder);
+                    trash.add(gamePath + graphicsFolder);
             }
         }
+
+        if (waitForCleanup)
+            trash.wait();
+        else
+            trash.detach();
     } catch (std::runtime_error &e) {
         std::cout << "error: " << e.what() << std::endl;
         return 1;
@@ -8,16 +8,16 @@
 #include "util.h"
 
 //MUST BE A MULTIPLE OF 4
-#define FILE_BUFFER_SIZE 1024
+#define FILE_BUFFER_SIZE (64 * 1024)
 
 namespace Rgssa1
 {
-void unpack(ifstream &file, const std::string &outpath, size_t fileSize);
+void unpack(File &file, OutputTree &tree);
 }
 
 namespace Rgssa3
 {
-void unpack(ifstream &file, const std::string &outpath);
+void unpack(File &file, OutputTree &tree);
 }
 
 namespace Rgssa
@@ -25,34 +25,31 @@ namespace Rgssa
 void unpack(const std::string &filename, const std::string &outpath)
 {
     try {
-        ifstream file(filename.c_str());
+        ::File file(filename, ::File::Read);
         assertMagicNumber(file);
         char version;
         file.read(&version, 1);
+        OutputTree tree(outpath);
         if (version == 1)
-            Rgssa1::unpack(file, outpath, Util::getFileSize(filename));
+            Rgssa1::unpack(file, tree);
         else if (version == 3)
-            Rgssa3::unpack(file, outpath);
+            Rgssa3::unpack(file, tree);
     } catch (std::runtime_error &e) {
         throw std::runtime_error(filename + ": " + e.what());
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(filename + ": i/o error: " + e.what());
     }
 }
 
 void listFilesRecursively(std::vector<File> &list, const std::string &realpath, const std::string &path)
 {
-    std::vector<std::string> files = Util::listFiles(realpath);
+    std::vector<Util::DirEntry> entries = Util::listEntries(realpath, true);
 
-    for (unsigned int i = 0; i < files.size(); ++i) {
-        if (Util::dirExists(realpath + files[i]))
-            listFilesRecursively(list, realpath + files[i] + PATH_SEPARATOR, path + files[i] + PATH_SEPARATOR);
-        else
-            list.push_back(File(path + files[i], Util::getFileSize(realpath + files[i])));
+    for (unsigned int i = 0; i < entries.size(); ++i) {
+        if (entries[i].type == Util::DirEntry::File)
+            list.push_back(File(path + entries[i].name, entries[i].size));
     }
 }
 
-void assertMagicNumber(ifstream &file)
+void assertMagicNumber(::File &file)
 {
     char magicNum[sizeof(RGSSA_MAGIC_NUM)];
     file.read(magicNum, sizeof(magicNum));
@@ -60,36 +57,45 @@ void assertMagicNumber(ifstream &file)
         throw std::runtime_error("does not appear to be a valid RGSS archive");
 }
 
-void extractFile(ifstream &file, Key key, const std::string &outname, size_t size) {
-    Util::mkdirsForFile(outname);
-    ofstream outfile(outname.c_str());
+void extractFile(::File &file, Key key, OutputTree &tree, const std::string &outname, uint64_t offset, size_t size) {
+    FILE *outfile = tree.create(outname);
 
-    char buffer[FILE_BUFFER_SIZE];
-    for (size_t bytesDone = 0; bytesDone < size; bytesDone += FILE_BUFFER_SIZE) {
-        //Read data into buffer, decrypt
-        size_t bytesRead = (size - bytesDone < FILE_BUFFER_SIZE) ? size - bytesDone : FILE_BUFFER_SIZE;
-        file.read(buffer, bytesRead);
-        for (unsigned int i = 0; i < bytesRead; ++i) {
-            buffer[i] ^= key.c[i % 4];
-            if (i % 4 == 3) {
-                key.i *= 7;
-                key.i += 3;
+    std::vector<char> buffer(FILE_BUFFER_SIZE);
+    try {
+        for (size_t bytesDone = 0; bytesDone < size; bytesDone += FILE_BUFFER_SIZE) {
+            //Read data into buffer, decrypt
+            size_t bytesRead = (size - bytesDone < FILE_BUFFER_SIZE) ? size - bytesDone : FILE_BUFFER_SIZE;
+            if (file.pread(buffer.data(), bytesRead, offset + bytesDone) != bytesRead)
+                throw std::runtime_error("unexpected end of file");
+            for (unsigned int i = 0; i < bytesRead; ++i) {
+                buffer[i] ^= key.c[i % 4];
+                if (i % 4 == 3) {
+                    key.i *= 7;
+                    key.i += 3;
+                }
             }
-        }
 
-        //Write data to out buffer
-        outfile.write(buffer, bytesRead);
+            //Write data to out buffer
+            if (fwrite(buffer.data(), 1, bytesRead, outfile) != bytesRead)
+                throw std::runtime_error(tree.getRoot() + outname + ": could not write file");
+        }
+    } catch (...) {
+        fclose(outfile);
+        throw;
     }
+    if (fclose(outfile) != 0)
+        throw std::runtime_error(tree.getRoot() + outname + ": could not write file");
 }
 
-void embedFile(ofstream &file, Key key, const std::string &srcname, size_t size) {
-    ifstream infile(srcname.c_str());
+void embedFile(::File &file, Key key, const std::string &srcname, size_t size) {
+    ::File infile(srcname, ::File::Read);
 
-    char buffer[FILE_BUFFER_SIZE];
+    std::vector<char> buffer(FILE_BUFFER_SIZE);
     for (size_t bytesDone = 0; bytesDone < size; bytesDone += FILE_BUFFER_SIZE) {
         //Read data into buffer, decrypt
         size_t bytesRead = (size - bytesDone < FILE_BUFFER_SIZE) ? size - bytesDone : FILE_BUFFER_SIZE;
-        infile.read(buffer, bytesRead);
+        if (infile.pread(buffer.data(), bytesRead, bytesDone) != bytesRead)
+            throw std::runtime_error(srcname + ": unexpected end of file");
         for (unsigned int i = 0; i < bytesRead; ++i) {
             buffer[i] ^= key.c[i % 4];
             if (i % 4 == 3) {
@@ -99,7 +105,7 @@ void embedFile(ofstream &file, Key key, const std::string &srcname, size_t size)
         }
 
         //Write data to out buffer
-        file.write(buffer, bytesRead);
+        file.write(buffer.data(), bytesRead);
     }
 }
 }
@@ -5,6 +5,8 @@
 #include <stdint.h>
 
 #include "os.h"
+#include "file.h"
+#include "outputtree.h"
 
 #define RGSSA_MAGIC_NUM "RGSSAD"
 
@@ -31,9 +33,9 @@ union Key
 void unpack(const std::string &filename, const std::string &outpath);
 
 void listFilesRecursively(std::vector<File> &list, const std::string &realpath, const std::string &path);
-void assertMagicNumber(ifstream &stream);
-void extractFile(ifstream &file, Key key, const std::string &outname, size_t size);
-void embedFile(ofstream &file, Key key, const std::string &srcname, size_t size);
+void assertMagicNumber(::File &file);
+void extractFile(::File &file, Key key, OutputTree &tree, const std::string &outname, uint64_t offset, size_t size);
+void embedFile(::File &file, Key key, const std::string &srcname, size_t size);
 }
 
 #endif // RGSSA_H
@@ -11,15 +11,15 @@
 namespace Rgssa1
 {
 
-void writeSize(ofstream &file, Rgssa::Key &key, size_t value)
+void writeSize(File &file, Rgssa::Key &key, size_t value)
 {
     value ^= key.i;
-    file.write(reinterpret_cast<char*>(&value), 4);
+    file.write(&value, 4);
     key.i *= 7;
     key.i += 3;
 }
 
-void writeString(ofstream &file, Rgssa::Key &key, const std::string &string)
+void writeString(File &file, Rgssa::Key &key, const std::string &string)
 {
     //Write size of string
     writeSize(file, key, string.size());
@@ -47,8 +47,14 @@ void pack(const std::string &filename, const std::string &srcpath, const std::ve
     try {
         char version = 1;
 
+        //Reserve space for the whole archive
+        uint64_t archiveSize = sizeof(RGSSA_MAGIC_NUM) + 1;
+        for (unsigned int i = 0; i < srcfiles.size(); ++i)
+            archiveSize += 4 + srcfiles[i].name.size() + 4 + srcfiles[i].size;
+
         //Write magic num + version
-        ofstream file(filename.c_str());
+        File file(filename, File::Write);
+        file.preallocate(archiveSize);
         file.write(RGSSA_MAGIC_NUM, sizeof(RGSSA_MAGIC_NUM));
         file.write(&version, 1);
 
@@ -59,24 +65,23 @@ void pack(const std::string &filename, const std::string &srcpath, const std::ve
             writeSize(file, key, srcfiles[i].size);
             Rgssa::embedFile(file, key, srcpath + srcfiles[i].name, srcfiles[i].size);
         }
+        file.close();
     } catch (std::runtime_error &e) {
         throw std::runtime_error(filename + ": " + e.what());
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(filename + ": i/o error: " + e.what());
     }
 }
 
-size_t readSize(ifstream &file, Rgssa::Key &key)
+size_t readSize(File &file, Rgssa::Key &key)
 {
     size_t value = 0;
-    file.read(reinterpret_cast<char*>(&value), 4);
+    file.read(&value, 4);
     value ^= key.i;
     key.i *= 7;
     key.i += 3;
     return value;
 }
 
-std::string readString(ifstream &file, Rgssa::Key &key)
+std::string readString(File &file, Rgssa::Key &key)
 {
     //Get size of string
     size_t size = readSize(file, key);
@@ -102,16 +107,19 @@ std::string readString(ifstream &file, Rgssa::Key &key)
     return std::string(buffer.begin(), buffer.end());
 }
 
-void unpack(ifstream &file, const std::string &outpath, size_t fileSize)
+void unpack(File &file, OutputTree &tree)
 {
+    uint64_t fileSize = file.size();
     Rgssa::Key key = {RGSSA1_KEY};
     for (;;) {
         std::string outname = readString(file, key);
         size_t size = readSize(file, key);
-        Rgssa::extractFile(file, key, outpath + outname, size);
+        uint64_t offset = file.tell();
+        Rgssa::extractFile(file, key, tree, outname, offset, size);
+        file.seek(offset + size);
 
         //Stop reading at end of file
-        if (static_cast<size_t>(file.tellg()) == fileSize)
+        if (file.tell() == fileSize)
             break;
     }
 }
@@ -21,13 +21,13 @@ static inline Rgssa::Key generateKey()
     return key;
 }
 
-void writeSize(ofstream &file, Rgssa::Key key, size_t value)
+void writeSize(File &file, Rgssa::Key key, size_t value)
 {
     value ^= key.i;
-    file.write(reinterpret_cast<char*>(&value), 4);
+    file.write(&value, 4);
 }
 
-void writeString(ofstream &file, Rgssa::Key key, const std::string &string) {
+void writeString(File &file, Rgssa::Key key, const std::string &string) {
     //Write size of string
     writeSize(file, key, string.size());
 
@@ -64,13 +64,17 @@ void pack(const std::string &filename, const std::string &srcpath, const std::ve
         char version = 3;
 
         //Write magic num + version
-        ofstream file(filename.c_str());
+        File file(filename, File::Write);
+        uint64_t archiveSize = embedOffset;
+        for (unsigned int i = 0; i < srcfiles.size(); ++i)
+            archiveSize += srcfiles[i].size;
+        file.preallocate(archiveSize);
         file.write(RGSSA_MAGIC_NUM, sizeof(RGSSA_MAGIC_NUM));
         file.write(&version, 1);
 
         //Write the key
         Rgssa::Key key = generateKey();
-        file.write(reinterpret_cast<char*>(&key.i), 4);
+        file.write(&key.i, 4);
         key.i *= 9;
         key.i += 3;
 
@@ -92,21 +96,20 @@ void pack(const std::string &filename, const std::string &srcpath, const std::ve
         for (unsigned int i = 0; i < srcfiles.size(); ++i) {
             Rgssa::embedFile(file, fileKeys[i], srcpath + srcfiles[i].name, srcfiles[i].size);
         }
+        file.close();
     } catch (std::runtime_error &e) {
         throw std::runtime_error(filename + ": " + e.what());
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(filename + ": i/o error: " + e.what());
     }
 }
 
-size_t readSize(ifstream &file, Rgssa::Key key)
+size_t readSize(File &file, Rgssa::Key key)
 {
     size_t value = 0;
-    file.read(reinterpret_cast<char*>(&value), 4);
+    file.read(&value, 4);
     return value ^ key.i;
 }
 
-std::string readString(ifstream &file, Rgssa::Key &key)
+std::string readString(File &file, Rgssa::Key &key)
 {
     //Get size of string
     size_t size = readSize(file, key);
@@ -130,11 +133,11 @@ std::string readString(ifstream &file, Rgssa::Key &key)
     return std::string(buffer.begin(), buffer.end());
 }
 
-void unpack(ifstream &file, const std::string &outpath)
+void unpack(File &file, OutputTree &tree)
 {
     //Read key
     Rgssa::Key key;
-    file.read(reinterpret_cast<char*>(&key.i), 4);
+    file.read(&key.i, 4);
     key.i *= 9;
     key.i += 3;
 
@@ -148,10 +151,7 @@ void unpack(ifstream &file, const std::string &outpath)
         std::string outname = readString(file, key);
 
         //Extract
-        size_t pos = file.tellg();
-        file.seekg(offset);
-        Rgssa::extractFile(file, fileKey, outpath + outname, size);
-        file.seekg(pos);
+        Rgssa::extractFile(file, fileKey, tree, outname, offset, size);
     }
 }
 }
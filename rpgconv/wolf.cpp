@@ -6,6 +6,8 @@
 
 #include "os.h"
 #include "util.h"
+#include "file.h"
+#include "outputtree.h"
 
 //Extract defines
 #define FILE_BUFFER_SIZE 1024
@@ -206,12 +208,12 @@ public:
     std::string getFilename(unsigned int index);
     std::string getFilePath(unsigned int index);
 
-    void extractFile(const std::string &dataPath, unsigned int index);
+    void extractFile(OutputTree &tree, unsigned int index);
     void unpack(const std::string &outpath);
 
 private:
     size_t fileSize;
-    ifstream file;
+    ::File file;
     char key[WOLF_KEY_SIZE];
 
     std::vector<char> filenames;
@@ -221,8 +223,8 @@ private:
 
 void Archive::read(void *dst, size_t size)
 {
-    int offset = file.tellg() % WOLF_KEY_SIZE;
-    file.read(reinterpret_cast<char*>(dst), size);
+    int offset = file.tell() % WOLF_KEY_SIZE;
+    file.read(dst, size);
     for (unsigned int i = 0; i < size; ++i) {
         reinterpret_cast<char*>(dst)[i] ^= key[offset];
         offset = (offset + 1) % WOLF_KEY_SIZE;
@@ -261,9 +263,9 @@ std::string Archive::getFilePath(unsigned int index)
 
 Archive::Archive(const std::string &filename)
 {
-    //Get file size, open file stream
-    fileSize = Util::getFileSize(filename);
-    file.open(filename.c_str());
+    //Open file, get file size
+    file.open(filename, ::File::Read);
+    fileSize = file.size();
 
     //The first 12 bytes will help us decrypt the file
     file.read(key, sizeof(key));
@@ -296,42 +298,51 @@ Archive::Archive(const std::string &filename)
     directories = std::vector<Directory>((sizeFileInfo - offDirectories) / sizeof(Directory));
 
     //Read the file info into memory
-    file.seekg(offFilenames);
+    file.seek(offFilenames);
     read(filenames.data(), filenames.size());
-    file.seekg(offFilenames + offFiles);
+    file.seek(offFilenames + offFiles);
     read(files.data(), files.size() * sizeof(File));
-    file.seekg(offFilenames + offDirectories);
+    file.seek(offFilenames + offDirectories);
     read(directories.data(), directories.size() * sizeof(Directory));
 }
 
-void Archive::extractFile(const std::string &dataPath, unsigned int index)
+void Archive::extractFile(OutputTree &tree, unsigned int index)
 {
     const File &wolfFile = files[index];
-    std::ofstream outfile((dataPath + getFilePath(index)).c_str());
+    std::string filePath = getFilePath(index);
+    FILE *outfile = tree.create(filePath);
 
     //Write the file to the disk
     size_t size = wolfFile.size;
-    file.seekg(0x18 + wolfFile.offData);
-
-    if (wolfFile.sizePress == NOT_COMPRESSED) {
-        char buffer[FILE_BUFFER_SIZE];
-        for (size_t bytesDone = 0; bytesDone < size; bytesDone += FILE_BUFFER_SIZE) {
-            //Read data into buffer
-            size_t bytesRead = (size - bytesDone < FILE_BUFFER_SIZE) ? size - bytesDone : FILE_BUFFER_SIZE;
-            read(buffer, bytesRead);
-            //Write data to out buffer
-            outfile.write(buffer, bytesRead);
+    bool success = true;
+    try {
+        file.seek(0x18 + wolfFile.offData);
+
+        if (wolfFile.sizePress == NOT_COMPRESSED) {
+            char buffer[FILE_BUFFER_SIZE];
+            for (size_t bytesDone = 0; success && bytesDone < size; bytesDone += FILE_BUFFER_SIZE) {
+                //Read data into buffer
+                size_t bytesRead = (size - bytesDone < FILE_BUFFER_SIZE) ? size - bytesDone : FILE_BUFFER_SIZE;
+                read(buffer, bytesRead);
+                //Write data to out buffer
+                success = fwrite(buffer, 1, bytesRead, outfile) == bytesRead;
+            }
+        } else {
+            //Read and decompress the data
+            std::vector<uint8_t> dataSrc(wolfFile.sizePress);
+            std::vector<uint8_t> dataDst(size);
+            read(dataSrc.data(), dataSrc.size());
+            size = decompress(dataDst.data(), dataSrc.data());
+
+            //Write to the file
+            success = fwrite(dataDst.data(), 1, size, outfile) == size;
         }
-    } else {
-        //Read and decompress the data
-        std::vector<uint8_t> dataSrc(wolfFile.sizePress);
-        std::vector<uint8_t> dataDst(size);
-        read(dataSrc.data(), dataSrc.size());
-        size = decompress(dataDst.data(), dataSrc.data());
-
-        //Write to the file
-        outfile.write(reinterpret_cast<char*>(dataDst.data()), size);
+    } catch (...) {
+        fclose(outfile);
+        throw;
     }
+    if (fclose(outfile) != 0 || !success)
+        throw std::runtime_error(tree.getRoot() + filePath + ": could not write file");
 }
 
 void Archive::unpack(const std::string &outpath)
@@ -339,14 +350,14 @@ void Archive::unpack(const std::string &outpath)
     std::string dataPath = outpath + "Data" PATH_SEPARATOR;
 
     //Extract everything
-    Util::mkdir(dataPath);
+    OutputTree tree(dataPath);
     for (unsigned int i = 1; i < files.size(); ++i) {
         if (files[i].attributes & ATTRIBUTE_DIRECTORY) {
             //Create directory
-            Util::mkdir(dataPath + getFilePath(i));
+            tree.mkdirs(getFilePath(i) + PATH_SEPARATOR);
         } else {
             //Extract the file
-            extractFile(dataPath, i);
+            extractFile(tree, i);
         }
     }
 
@@ -364,8 +375,6 @@ void unpack(const std::string &filename, const std::string &outpath)
         archive.unpack(outpath);
     } catch (std::runtime_error &e) {
         throw std::runtime_error(filename + ": " + e.what());
-    } catch (ifstream::failure &e) {
-        throw std::runtime_error(filename + ": i/o error: " + e.what());
     }
 }
 }
@@ -2,38 +2,75 @@
 #include <vector>
 #include <stdexcept>
 
+#include <cstdlib>
+
 #include "bitmap.h"
+#include "imagestream.h"
+#include "contenthash.h"
 #include "util.h"
 
-int unimain(const std::vector<std::string> &args)
+int unimain(const std::vector<std::string> &argv)
 {
+    //Split off flags
+    unsigned int scale = 1;
+    bool hash = false;
+    std::vector<std::string> args;
+    for (unsigned int i = 0; i < argv.size(); ++i) {
+        if (argv[i] == "--hash")
+            hash = true;
+        else if (argv[i] == "--scale" && i + 1 < argv.size())
+            scale = atoi(argv[++i].c_str());
+        else
+            args.push_back(argv[i]);
+    }
+
     if (args.size() == 0) {
-        std::cerr << "usage: xyz files_to_convert..." << std::endl;
+        std::cerr << "usage: xyz [--scale N] files_to_convert..." << std::endl;
+        std::cerr << "       xyz --hash files_to_hash..." << std::endl;
         return 1;
     }
+    if (scale < 1 || scale > BITMAP_MAX_SCALE) {
+        std::cerr << "error: --scale must be between 1 and " << BITMAP_MAX_SCALE << std::endl;
+        return 1;
+    }
+
+    if (hash) {
+        //Print content hashes instead, in the order given
+        std::vector<std::string> hashes, errors;
+        hashImageFiles(args, hashes, errors);
+        for (unsigned int i = 0; i < args.size(); ++i) {
+            if (hashes[i].empty())
+                std::cerr << "warning: " << errors[i] << std::endl;
+            else
+                std::cout << hashes[i] << "  " << args[i] << std::endl;
+        }
+        return 0;
+    }
 
     for (unsigned int i = 0; i < args.size(); ++i) {
-        //Load the bitmap
-        Bitmap bitmap;
+        //Convert a row at a time; the image is never held in memory
+        std::string filename = Util::sanitizePath(args[i]);
+        std::string outname = Util::getWithoutExtension(filename) + ".";
         try {
-            bitmap = Bitmap(args[i]);
+            ImageReader image(args[i]);
+            if (image.getFormat() == ImageReader::Unknown) {
+                std::cerr << "warning: " << args[i] << ": could not determine file type" << std::endl;
+                continue;
+            }
+
+            //XYZ becomes PNG, anything else XYZ; never overwrite the input
+            std::string ext = image.getFormat() == ImageReader::Xyz ? "png" : "xyz";
+            if (Util::getExtension(filename) == ext) {
+                std::cerr << "warning: " << args[i] << ": contents do not match the extension; skipped" << std::endl;
+                continue;
+            }
+            if (image.getFormat() == ImageReader::Xyz)
+                Bitmap::transcodeToPng(image, outname + ext, false, scale);
+            else
+                Bitmap::transcodeToXyz(image, outname + ext, scale);
         } catch (std::runtime_error &e) {
             std::cerr << "warning: " << e.what() << std::endl;
-            continue;
-        }
-        if (bitmap.empty()) {
-            std::cerr << "warning: " << args[i] << ": could not read file" << std::endl;
-            continue;
         }
-
-        //Write to file
-        std::string filename = Util::sanitizePath(args[i]);
-        std::string ext = Util::getExtension(filename);
-        std::string outname = Util::getWithoutExtension(filename) + ".";
-        if (ext == "xyz")
-            bitmap.writeToPng(outname + "png", false);
-        else
-            bitmap.writeToXyz(outname + "xyz");
     }
     return 0;
 }